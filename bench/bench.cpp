@@ -0,0 +1,413 @@
+// Counts the calls to operator new of each case
+#define CONTEXTUAL_ALLOCATION_IMPLEMENTATION
+#include <contextual.h>
+#include <contextual/allocation.h>
+#include <contextual/exit_stack.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+
+Microbenchmarks of the cost of entering and leaving a context, next to the
+plain RAII guard and hand-written try/catch that a context replaces.
+
+Every case is run for a fixed number of iterations and reported as one JSON
+object per line of a "benchmarks" array on stdout:
+
+	ns_per_op			wall-clock time per iteration
+	allocations_per_op	calls to the global operator new per iteration
+	instructions_per_op	retired user-space instructions per iteration, or
+						null where hardware counters are not available
+
+Build and run with `make bench`.
+
+*/
+
+/************************************
+*									*
+* 	Measurement						*
+*									*
+************************************/
+
+namespace {
+
+	// Keeps the optimizer from discarding a value or assuming memory is
+	// unchanged across it
+	template <class value>
+	inline void keep(value& v){
+		asm volatile("" : : "r,m"(v) : "memory");
+	}
+
+	class InstructionCounter {
+	private:
+		int _fd = -1;
+
+	public:
+		InstructionCounter(){
+			perf_event_attr attributes;
+			std::memset(&attributes, 0, sizeof(attributes));
+			attributes.size = sizeof(attributes);
+			attributes.type = PERF_TYPE_HARDWARE;
+			attributes.config = PERF_COUNT_HW_INSTRUCTIONS;
+			attributes.disabled = 1;
+			attributes.exclude_kernel = 1;
+			attributes.exclude_hv = 1;
+			_fd = static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+		}
+		~InstructionCounter(){
+			if (_fd >= 0) {
+				close(_fd);
+			}
+		}
+
+		bool available() const { return _fd >= 0; }
+
+		void start(){
+			if (_fd >= 0) {
+				ioctl(_fd, PERF_EVENT_IOC_RESET, 0);
+				ioctl(_fd, PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+
+		long long stop(){
+			long long count = 0;
+			if (_fd >= 0) {
+				ioctl(_fd, PERF_EVENT_IOC_DISABLE, 0);
+				if (read(_fd, &count, sizeof(count)) != sizeof(count)) {
+					count = 0;
+				}
+			}
+			return count;
+		}
+	};
+
+	struct Options {
+		long iterations = 1000000;
+		std::string filter;
+	};
+
+	Options OPTIONS;
+	bool FIRST = true;
+
+	template <class operation>
+	void run(const char* name, operation&& op, long iterations=OPTIONS.iterations){
+		if (!OPTIONS.filter.empty() && std::string(name).find(OPTIONS.filter) == std::string::npos) {
+			return;
+		}
+		// warm up caches and branch predictors
+		for (long i = 0; i < std::min(iterations / 10, 10000L); ++i) {
+			op();
+		}
+
+		InstructionCounter instructions;
+		std::uint64_t allocations = Contextual::thread_allocations().allocations;
+		instructions.start();
+		auto start = std::chrono::steady_clock::now();
+		for (long i = 0; i < iterations; ++i) {
+			op();
+		}
+		auto stop = std::chrono::steady_clock::now();
+		long long retired = instructions.stop();
+		allocations = Contextual::thread_allocations().allocations - allocations;
+
+		double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+		std::printf("%s\n    {\"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.3f, "
+					"\"allocations_per_op\": %.3f, \"instructions_per_op\": ",
+					FIRST ? "" : ",", name, iterations, ns / iterations,
+					static_cast<double>(allocations) / iterations);
+		if (instructions.available()) {
+			std::printf("%.1f}", static_cast<double>(retired) / iterations);
+		} else {
+			std::printf("null}");
+		}
+		FIRST = false;
+	}
+
+};
+
+/************************************
+*									*
+* 	Resources under test			*
+*									*
+************************************/
+
+namespace Contextual {
+
+	struct IData {
+		std::string username;
+		std::string password;
+		bool logged_in = false;
+	};
+
+	// The password masking resource of example.cpp
+	class Resource : public StaticResource<Resource, IData> {
+	private:
+		friend struct ContextAccess;
+		std::string _password = "xxxxxxxxx";
+		void enter() {
+			std::swap(_password, resources->password);
+		}
+
+		bool exit(std::exception_ptr e) {
+			std::swap(_password, resources->password);
+			resources->logged_in = true;
+			return true;
+		}
+	public:
+		Resource(IData &resources): StaticResource<Resource, IData>(resources){};
+	};
+
+	// The same through the virtual interface
+	class VirtualResource : public IResource<IData> {
+	private:
+		std::string _password = "xxxxxxxxx";
+		void enter() override {
+			std::swap(_password, resources->password);
+		}
+
+		bool exit(std::exception_ptr e) override {
+			std::swap(_password, resources->password);
+			resources->logged_in = true;
+			return true;
+		}
+	public:
+		VirtualResource(IData &resources): IResource<IData>(resources){};
+	};
+
+	// The same as a plain RAII guard
+	class Guard {
+	private:
+		IData& _data;
+		std::string _password = "xxxxxxxxx";
+	public:
+		Guard(IData& data): _data(data){
+			std::swap(_password, _data.password);
+		}
+		~Guard(){
+			std::swap(_password, _data.password);
+			_data.logged_in = true;
+		}
+	};
+
+	// The smallest possible resource, to isolate the cost of the context
+	class Counter : public StaticResource<Counter, long> {
+	private:
+		friend struct ContextAccess;
+		void enter() noexcept {
+			++*resources;
+		}
+
+		bool exit(std::exception_ptr e) noexcept {
+			--*resources;
+			return true;
+		}
+	public:
+		Counter(long &resources): StaticResource<Counter, long>(resources){};
+	};
+
+	// The context manager as it was before code blocks were taken by
+	// template parameter: the block is held in an optional std::function,
+	// copied on the way in, and errors are reported as sliced copies
+	class LegacyWith {
+	private:
+		std::optional<std::function<void(IData*)>> _context = {};
+
+	public:
+		LegacyWith(const std::optional<std::function<void(IData*)>>& context, IData* resources,
+				   std::string& password): _context(context){
+			try{
+				std::swap(password, resources->password);
+				if (_context){
+					_context.value()(resources);
+				}
+			} catch (std::exception& e) {
+				std::optional<std::exception> error = e;
+				keep(error);
+				std::swap(password, resources->password);
+				return;
+			}
+			std::swap(password, resources->password);
+		}
+	};
+
+};
+
+using namespace Contextual;
+
+/************************************
+*									*
+* 	The cases						*
+*									*
+************************************/
+
+int main(int argc, char** argv){
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+			OPTIONS.iterations = std::atol(argv[++i]);
+		} else if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+			OPTIONS.filter = argv[++i];
+		} else {
+			std::fprintf(stderr, "usage: %s [--iterations N] [--filter NAME]\n", argv[0]);
+			return 1;
+		}
+	}
+	// exceptions are far slower than everything else, so fewer iterations
+	long throwing = std::max(OPTIONS.iterations / 100, 1L);
+
+	IData data{"admin", "password123"};
+	long counter = 0;
+	long sum = 0;
+
+	std::printf("{\"benchmarks\": [");
+
+	// baselines
+	run("baseline/raii_guard", [&]{
+		Guard guard(data);
+		sum += data.password.size();
+		keep(sum);
+	});
+	run("baseline/try_catch", [&]{
+		std::string password = "xxxxxxxxx";
+		std::swap(password, data.password);
+		try{
+			sum += data.password.size();
+			keep(sum);
+		} catch (...) {
+			std::swap(password, data.password);
+			throw;
+		}
+		std::swap(password, data.password);
+	});
+
+	// the cost of the context itself
+	run("with/empty_block", [&]{
+		with { Counter(counter)() };
+		keep(counter);
+	});
+	run("with/counter", [&]{
+		with {
+			Counter(counter)([&](long* c) noexcept { sum += *c; })
+		};
+		keep(sum);
+	});
+
+	// the password swap of example.cpp
+	run("with/password_swap", [&]{
+		with {
+			Resource(data)([&](IData* d){ sum += d->password.size(); })
+		};
+		keep(sum);
+	});
+	run("with/password_swap_virtual", [&]{
+		with {
+			VirtualResource(data)([&](IData* d){ sum += d->password.size(); })
+		};
+		keep(sum);
+	});
+	run("with/password_swap_std_function", [&]{
+		std::string password = "xxxxxxxxx";
+		LegacyWith {
+			[&](IData* d){ sum += d->password.size(); },
+			&data, password
+		};
+		keep(sum);
+	});
+	run("with_result/password_swap", [&]{
+		sum += with_result(Resource(data), [&](IData* d){ return d->password.size(); });
+		keep(sum);
+	});
+
+	// nesting
+	run("with/nested_3", [&]{
+		with {
+			Counter(counter)([&](long*) noexcept {
+				with {
+					Counter(counter)([&](long*) noexcept {
+						with {
+							Counter(counter)([&](long* c) noexcept { sum += *c; })
+						};
+					})
+				};
+			})
+		};
+		keep(sum);
+	});
+	run("with_all/3", [&]{
+		with {
+			with_all(Counter(counter), Counter(counter), Counter(counter))(
+				[&](long*, long*, long* c) noexcept { sum += *c; }
+			)
+		};
+		keep(sum);
+	});
+	run("with_all/password_swap_3", [&]{
+		with {
+			with_all(Resource(data), Resource(data), Resource(data))(
+				[&](IData* d, IData*, IData*){ sum += d->password.size(); }
+			)
+		};
+		keep(sum);
+	});
+	run("exit_stack/4", [&]{
+		with {
+			ExitStack<>()([&](auto stack){
+				for (int i = 0; i < 4; ++i) {
+					stack->enter_context(Counter(counter));
+				}
+				stack->callback([&]{ ++sum; });
+			})
+		};
+		keep(sum);
+	});
+	run("baseline/nested_3_raii", [&]{
+		Guard a(data);
+		{
+			Guard b(data);
+			{
+				Guard c(data);
+				sum += data.password.size();
+				keep(sum);
+			}
+		}
+	});
+
+	// blocks that throw
+	run("with/throwing_block", [&]{
+		with {
+			Resource(data)([&](IData*){ throw std::runtime_error("bench"); })
+		};
+		keep(data);
+	}, throwing);
+	run("with/throwing_block_std_function", [&]{
+		std::string password = "xxxxxxxxx";
+		LegacyWith {
+			[&](IData*){ throw std::runtime_error("bench"); },
+			&data, password
+		};
+		keep(data);
+	}, throwing);
+	run("baseline/throwing_try_catch", [&]{
+		try{
+			Guard guard(data);
+			throw std::runtime_error("bench");
+		} catch (...) {
+		}
+		keep(data);
+	}, throwing);
+
+	std::printf("\n]}\n");
+	return 0;
+}
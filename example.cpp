@@ -15,30 +15,47 @@ namespace Contextual {
 
 
 
-	class Resource : public IResource<IData> {
+	class Resource : public StaticResource<Resource, IData> {
 	private:
+		friend struct ContextAccess;
 		std::string _password = "xxxxxxxxx";
-		IData _data;
-		void enter() override {
+		void enter() {
 			std::swap(_password, resources->password);
 		}
 
-		void exit(std::optional<std::exception> e) override {
+		bool exit(std::exception_ptr e) {
 			std::swap(_password, resources->password);
 			resources->logged_in = true;
-
+			return true;
 		}
 	public:
-		Resource(IData* resources): IResource<IData>(resources){};
-		Resource(IData &resources): IResource<IData>(resources){};
-		Resource(IData &&resources): IResource<IData>(&resources){};
-		Resource(std::string username, std::string password) : IResource<IData>(_data),
-															   _data(IData{username, password})
-		 													   {};
+		Resource(IData* resources): StaticResource<Resource, IData>(resources){};
+		Resource(IData &resources): StaticResource<Resource, IData>(resources){};
+		Resource(IData &&resources): StaticResource<Resource, IData>(&resources){};
 	
 
 
 	};
+
+	// Owns its data instead of pointing at the caller's, so it can be
+	// built from temporaries without anything dangling
+	class Session : public StaticResource<Session, IData, Owned> {
+	private:
+		friend struct ContextAccess;
+		std::string _password = "xxxxxxxxx";
+		void enter() {
+			std::swap(_password, resources->password);
+		}
+
+		bool exit(std::exception_ptr e) {
+			std::swap(_password, resources->password);
+			resources->logged_in = true;
+			return true;
+		}
+	public:
+		Session(std::string username, std::string password) : 
+			StaticResource<Session, IData, Owned>(std::in_place, username, password){};
+	};
 };
 	
 
@@ -69,7 +86,7 @@ int main(){
 	std::cout << "\n====================================\n\n";
 
 	with {
-		Resource("admin", "password123")(
+		Session("admin", "password123")(
 			eval {
 				std::cout << "Username: " << resource->username << "\n";
 				std::cout << "Password: " << resource->password << "\n";
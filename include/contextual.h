@@ -2,9 +2,15 @@
 #define CONTEXTUAL_H
 
 #include <iostream>
-#include <functional>
-#include <optional>
+#include <utility>
 #include <exception>
+#include <type_traits>
+#include <variant>
+#include <tuple>
+#include <system_error>
+#include <stdexcept>
+#include <new>
+#include <contextual/instrument.h>
 
 #define with (void) With
 /*
@@ -42,33 +48,229 @@ namespace Contextual {
 
 // Forward declaration of the With class
 class With;
-// The struct that will hold the resources acquired for the context,
-// to be defined by user
-struct IData;
+// Forward declaration of the resource manager interface and its default
+// storage policy
+template <class data>
+class Borrowed;
+template <class data, template <class> class storage = Borrowed>
+class IResource;
 
 /********************************************
 *											*
-* 	The resource manager class interface	*
+* 	Access to the enter and exit methods	*
 *											*
 ********************************************/
 
+// The context manager reaches the enter and exit methods of a resource
+// manager through here, so that they can stay protected. Resource managers
+// derived from StaticResource that keep enter and exit private should
+// declare it a friend.
+struct ContextAccess {
+private:
+	template <class data, template <class> class storage>
+	static std::true_type _is_interface(const IResource<data, storage>*);
+	static std::false_type _is_interface(const void*);
+
+public:
+	// The object a context calls enter and exit on when it is handed a
+	// resource manager by its own type: an IResource through the interface,
+	// where the overrides are reachable, anything else as it is.
+	template <class resource>
+	static auto& handle(resource& r){
+		if constexpr (decltype(_is_interface(&r))::value) {
+			return _upcast(r);
+		} else {
+			return r;
+		}
+	}
+
+	template <class resource>
+	static void enter(resource& r) noexcept(noexcept(r.enter())){
+		r.enter();
+	}
+
+	template <class resource, class error>
+	static bool exit(resource& r, const error& e) noexcept(noexcept(r.exit(e))){
+		return r.exit(e);
+	}
+
+	// The awaitable counterparts of enter and exit, for co_with
+	template <class resource>
+	static auto async_enter(resource& r){
+		return r.async_enter();
+	}
+
+	template <class resource>
+	static auto async_exit(resource& r, std::exception_ptr e){
+		return r.async_exit(e);
+	}
+
+	template <class resource>
+	static auto get(resource& r) noexcept{
+		return r.resources.get();
+	}
+
+private:
+	template <class data, template <class> class storage>
+	static IResource<data, storage>& _upcast(IResource<data, storage>& r){
+		return r;
+	}
+};
+
+// Whether a context can throw at all: true when the resource manager's
+// enter and exit and the code block are all noexcept. Such a context is
+// run with no exception handler, so
+//
+//		static_assert(is_nothrow_context_v<Resource, decltype(block)>);
+//
+// asserts that a resource manager and code block take that path.
+template <class resource, class block>
+struct is_nothrow_context {
+private:
+	using manager = std::remove_reference_t<decltype(ContextAccess::handle(std::declval<resource&>()))>;
+	using data_pointer = decltype(ContextAccess::get(std::declval<manager&>()));
+
+public:
+	static constexpr bool value = noexcept(ContextAccess::enter(std::declval<manager&>())) &&
+								  noexcept(ContextAccess::exit(std::declval<manager&>(), std::exception_ptr())) &&
+								  std::is_nothrow_invocable<block, data_pointer>::value;
+};
+
+template <class resource, class block>
+inline constexpr bool is_nothrow_context_v = is_nothrow_context<resource, block>::value;
+
+// The struct of resources a resource manager hands to its code block. Each
+// resource manager names its own, so a context only carries the fields it
+// actually needs.
+template <class resource>
+using resource_data_t = typename resource::data_type;
+
+/********************************************
+*											*
+* 	Storage policies for the resources		*
+*											*
+********************************************/
+
+// How a resource manager holds its data. Both policies are used through
+// ->, * and get(), so enter and exit are written the same way for either.
+
+// Keeps a pointer to data that the caller owns and must keep alive for the
+// duration of the context. This is the default.
+template <class data>
+class Borrowed {
+private:
+	data* _resources = nullptr;
+
+public:
+	Borrowed() = default;
+	Borrowed(data& resources) : _resources(&resources){};
+	Borrowed(data* resources) : _resources(resources){};
+
+	data* get() const { return _resources; }
+	data* operator->() const { return _resources; }
+	data& operator*() const { return *_resources; }
+};
+
+// Embeds the data by value in the resource manager, so it lives exactly as
+// long as the context and is reached without loading a pointer. It can be
+// copied or moved in, or constructed in place from the arguments following
+// std::in_place.
 template <class data>
+class Owned {
+private:
+	data _resources;
+
+	template <class... args>
+	static data _make(args&&... arguments){
+		if constexpr (std::is_constructible<data, args&&...>::value) {
+			return data(std::forward<args>(arguments)...);
+		} else {
+			return data{std::forward<args>(arguments)...};
+		}
+	}
+
+public:
+	Owned() = default;
+	Owned(const data& resources) : _resources(resources){};
+	Owned(data&& resources) : _resources(std::move(resources)){};
+	template <class... args>
+	Owned(std::in_place_t, args&&... arguments) : _resources(_make(std::forward<args>(arguments)...)){};
+
+	data* get() { return &_resources; }
+	const data* get() const { return &_resources; }
+	data* operator->() { return &_resources; }
+	const data* operator->() const { return &_resources; }
+	data& operator*() { return _resources; }
+	const data& operator*() const { return _resources; }
+};
+
+/********************************************
+*											*
+* 	The resource manager class interface	*
+*											*
+********************************************/
+
+template <class data, template <class> class storage>
 class IResource {	
 protected:
 	// The actual resources
 	
-	data* resources;
+	storage<data> resources;
 	virtual void enter() = 0;
-	virtual void exit(std::optional<std::exception> e) = 0;
+	// Receives the exception thrown by the code block, or a null pointer if
+	// it completed normally. Returning true suppresses the exception, as
+	// with Python's __exit__; otherwise it propagates out of the context.
+	virtual bool exit(std::exception_ptr e) = 0;
 
 public:
-	friend class With;
+	friend struct ContextAccess;
+	using data_type = data;
 	
-	IResource<data>() = default;
-	IResource<data>(data& resources) : resources(&resources){};
-	IResource<data>(data* resources) : resources(resources){};
+	IResource() = default;
+	// Any arguments the storage policy accepts: a reference or pointer for
+	// Borrowed, a value or std::in_place plus constructor arguments for Owned
+	template <class first, class... rest,
+			  class = std::enable_if_t<std::is_constructible<storage<data>, first&&, rest&&...>::value>>
+	IResource(first&& argument, rest&&... arguments) : resources(std::forward<first>(argument),
+																 std::forward<rest>(arguments)...){};
 	
-	With operator()(const std::optional<std::function<void(IData*)>>& code_block={});
+	template <class block>
+	With operator()(block&& code_block);
+	With operator()();
+	
+};
+
+/********************************************
+*											*
+* 	The statically dispatched resource		*
+*			manager base class				*
+*											*
+********************************************/
+
+// A CRTP alternative to IResource. The derived class declares plain
+// (non-virtual) enter and exit methods with the same signatures, and With
+// calls them directly on the derived type: no vtable pointer is stored and
+// small enter/exit bodies are inlined into the context.
+template <class derived, class data, template <class> class storage = Borrowed>
+class StaticResource {
+protected:
+	// The actual resources
+	
+	storage<data> resources;
+
+public:
+	friend struct ContextAccess;
+	using data_type = data;
+	
+	StaticResource() = default;
+	template <class first, class... rest,
+			  class = std::enable_if_t<std::is_constructible<storage<data>, first&&, rest&&...>::value>>
+	StaticResource(first&& argument, rest&&... arguments) : resources(std::forward<first>(argument),
+																	  std::forward<rest>(arguments)...){};
+	
+	template <class block>
+	With operator()(block&& code_block);
+	With operator()();
 	
 };
 
@@ -80,46 +282,471 @@ public:
 ************************************/
 
 class With {
-private:
-	std::optional<std::function<void(IData*)>> _context = {};
-		
 public:
-	IResource<IData>* resource;
 	// The rule of five
 	With() = delete;
 	With(const With& other) = delete;
+	// Only so that classes deriving from With can be brace-initialized from
+	// the temporary returned by IResource::operator(); the context has
+	// already run by then, so the moved-from With carries nothing.
+	With(With&& other) = default;
 	With& operator=(const With& other) = delete;
 	With& operator=(const With&& other) = delete;
 
 	~With() = default;
 	
-	With(std::optional<std::function<void(IData*)>> context,
-		 				 IResource<IData>* resource=nullptr):
-													 		_context(context),
-									 						resource(resource){
-		try{
+	// The code block is taken by its own type rather than through a
+	// std::function, so it is never copied or type-erased and the call
+	// can be inlined. It is run immediately, so it need not be stored.
+	// The resource manager is likewise taken by its own type: an IResource
+	// is driven through its vtable, a StaticResource without one.
+	//
+	// Exit is only called once enter has succeeded. Whatever the code block
+	// throws, std::exception or not, reaches exit as an exception_ptr to
+	// the original object; unless exit suppresses it, that same object is
+	// rethrown from the handler without being copied.
+	//
+	// A noexcept code block cannot leave anything for exit to handle, so it
+	// is run without a try/catch at all.
+	//
+	// When instrumentation is on, the probe times each phase for the
+	// observers in contextual/instrument.h; otherwise it is not there at all.
+	template <class block, class resource>
+	With(block&& code_block, resource* r){
+		_probe_t<resource> probe(*r);
+		ContextAccess::enter(*r);
+		probe.entered();
+		if constexpr (std::is_nothrow_invocable<block, decltype(ContextAccess::get(*r))>::value) {
 			// Execute the context
-			resource->enter();
-			if (_context){
-				_context.value()(resource->resources);
+			std::forward<block>(code_block)(ContextAccess::get(*r));
+		} else {
+			try{
+				// Execute the context
+				std::forward<block>(code_block)(ContextAccess::get(*r));
+			} catch (...) {
+				probe.failed();
+				// cleanup
+				if (!ContextAccess::exit(*r, std::current_exception())) {
+					throw;
+				}
+				return;
 			}
-		} catch (std::exception& e) {
-			// cleanup
-			resource->exit(e);
-			return;
 		}
-		resource->exit(std::nullopt);
+		probe.finished();
+		ContextAccess::exit(*r, nullptr);
 		
 	}
 
+	// A context with an empty code block
+	template <class resource>
+	explicit With(resource* r): With([](auto) noexcept {}, r){};
+
 };
 
 //********************************************************
 
-template <class data>
-With IResource<data>::operator()(const std::optional<std::function<void(IData*)>>& code_block){
-	return With(std::move(code_block), this);
+template <class data, template <class> class storage>
+template <class block>
+With IResource<data, storage>::operator()(block&& code_block){
+	return With(std::forward<block>(code_block), this);
+
+}
+
+template <class data, template <class> class storage>
+With IResource<data, storage>::operator()(){
+	return With(this);
+
+}
+
+template <class derived, class data, template <class> class storage>
+template <class block>
+With StaticResource<derived, data, storage>::operator()(block&& code_block){
+	return With(std::forward<block>(code_block), static_cast<derived*>(this));
+
+}
+
+template <class derived, class data, template <class> class storage>
+With StaticResource<derived, data, storage>::operator()(){
+	return With(static_cast<derived*>(this));
+
+}
+
+/************************************
+*									*
+* 	Contexts that return a value	*
+*									*
+************************************/
+
+// Calls exit on the normal path once the value of the code block has been
+// constructed in the caller's storage
+template <class resource>
+class _ExitOnReturn {
+public:
+	resource& manager;
+	_probe_t<resource>& probe;
+	bool armed = true;
+
+	~_ExitOnReturn() noexcept(noexcept(ContextAccess::exit(manager, nullptr))){
+		if (armed) {
+			probe.finished();
+			ContextAccess::exit(manager, nullptr);
+		}
+	}
+};
+
+// Runs a code block like With but returns its value, so results need not
+// leave through captured references:
+//
+//		auto v = with_result(Resource(x), [&](auto r){ return ...; });
+//
+// The value is constructed directly in the caller's storage, with no copy
+// or move, and exit runs after it. Exceptions are handled as by With; when
+// exit suppresses one there is no value, so a value-initialized result is
+// returned, or, if the result cannot be default-constructed, the exception
+// propagates after all.
+template <class resource, class block>
+std::invoke_result_t<block, decltype(ContextAccess::get(ContextAccess::handle(std::declval<resource&>())))>
+with_result(resource&& r, block&& code_block){
+	auto& manager = ContextAccess::handle(r);
+	using result = std::invoke_result_t<block, decltype(ContextAccess::get(manager))>;
+	using handle = std::remove_reference_t<decltype(manager)>;
+
+	_probe_t<handle> probe(manager);
+	ContextAccess::enter(manager);
+	probe.entered();
+	_ExitOnReturn<handle> guard{manager, probe};
+	if constexpr (std::is_nothrow_invocable<block, decltype(ContextAccess::get(manager))>::value) {
+		return std::forward<block>(code_block)(ContextAccess::get(manager));
+	} else {
+		try{
+			return std::forward<block>(code_block)(ContextAccess::get(manager));
+		} catch (...) {
+			guard.armed = false;
+			probe.failed();
+			if (ContextAccess::exit(manager, std::current_exception())) {
+				if constexpr (std::is_void<result>::value) {
+					return;
+				} else if constexpr (std::is_default_constructible<result>::value) {
+					return result();
+				}
+			}
+			throw;
+		}
+	}
+}
+
+/********************************************
+*											*
+* 	Several resource managers in one		*
+*				context						*
+*											*
+********************************************/
+
+// The resource manager built by with_all. It holds references to the
+// resource managers it was given, which are temporaries living until the
+// end of the with statement, and enters them left to right and exits them
+// in reverse. Exits are chained as in nested with blocks: once one
+// suppresses the exception the ones after it see none, and one that throws
+// replaces the exception for the rest. That goes for an enter that throws
+// too: the ones already entered are exited with its exception, and if one
+// of them suppresses it the code block is skipped, as it would be nested
+// inside them.
+template <class... managers>
+class All : public StaticResource<All<managers...>,
+								  std::tuple<decltype(ContextAccess::get(std::declval<managers&>()))...>,
+								  Owned> {
+private:
+	friend struct ContextAccess;
+	using _base = StaticResource<All<managers...>,
+								 std::tuple<decltype(ContextAccess::get(std::declval<managers&>()))...>,
+								 Owned>;
+	using _indices = std::index_sequence_for<managers...>;
+
+	static constexpr bool _nothrow_enter = (noexcept(ContextAccess::enter(std::declval<managers&>())) && ...);
+	static constexpr bool _nothrow_exit =
+		(noexcept(ContextAccess::exit(std::declval<managers&>(), std::exception_ptr())) && ...);
+
+	std::tuple<managers&...> _managers;
+	// Each is observed as its own context, nested in the group's
+	std::tuple<_probe_t<managers>...> _probes;
+	std::size_t _entered = 0;
+	// An enter failed and its exception was suppressed, so the group is
+	// already exited and the code block is not to run
+	bool _skipped = false;
+
+	// Only a throwing enter can leave the group partly entered, so only then
+	// is the count kept
+	template <std::size_t... i>
+	void _enter(std::index_sequence<i...>) noexcept(_nothrow_enter){
+		if constexpr (_nothrow_enter) {
+			(_enter_one<i>(), ...);
+		} else {
+			((_enter_one<i>(), ++_entered), ...);
+		}
+	}
+
+	template <std::size_t i>
+	void _enter_one() noexcept(_nothrow_enter){
+		std::get<i>(_probes).begin(std::get<i>(_managers));
+		ContextAccess::enter(std::get<i>(_managers));
+		std::get<i>(_probes).entered();
+	}
+
+	// Exits the entered resource managers from the last to the first
+	template <std::size_t... i>
+	void _exit(std::exception_ptr& e, bool& replaced, std::index_sequence<i...>) noexcept(_nothrow_exit){
+		constexpr std::size_t last = sizeof...(managers) - 1;
+		(_exit_one<last - i>(e, replaced), ...);
+	}
+
+	template <std::size_t i>
+	void _exit_one(std::exception_ptr& e, bool& replaced) noexcept(_nothrow_exit){
+		auto& probe = std::get<i>(_probes);
+		if (!_nothrow_enter && i >= _entered) {
+			// Ends the probe of the one whose enter threw
+			probe.end();
+			return;
+		}
+		if (e) {
+			probe.failed();
+		} else {
+			probe.finished();
+		}
+		if constexpr (_nothrow_exit) {
+			if (ContextAccess::exit(std::get<i>(_managers), e)) {
+				e = nullptr;
+			}
+		} else {
+			try{
+				if (ContextAccess::exit(std::get<i>(_managers), e)) {
+					e = nullptr;
+				}
+			} catch (...) {
+				e = std::current_exception();
+				replaced = true;
+			}
+		}
+		probe.end();
+	}
+
+	template <class block, std::size_t... i>
+	static constexpr bool _nothrow_block(std::index_sequence<i...>){
+		using data = typename _base::data_type;
+		return std::is_nothrow_invocable<block, std::tuple_element_t<i, data>&...>::value;
+	}
+
+	void enter() noexcept(_nothrow_enter){
+		_skipped = false;
+		if constexpr (_nothrow_enter) {
+			_enter(_indices());
+		} else {
+			_entered = 0;
+			try{
+				_enter(_indices());
+			} catch (...) {
+				std::exception_ptr e = std::current_exception();
+				bool replaced = false;
+				_exit(e, replaced, _indices());
+				if (!e) {
+					_skipped = true;
+					return;
+				}
+				if (replaced) {
+					std::rethrow_exception(e);
+				}
+				throw;
+			}
+		}
+		*this->resources = std::apply([](auto&... m){
+			return std::make_tuple(ContextAccess::get(m)...);
+		}, _managers);
+	}
+
+	bool exit(std::exception_ptr e) noexcept(_nothrow_exit){
+		if (!_nothrow_enter && _skipped) {
+			return false;
+		}
+		bool replaced = false;
+		_exit(e, replaced, _indices());
+		if (replaced && e) {
+			std::rethrow_exception(e);
+		}
+		return !e;
+	}
+
+public:
+	explicit All(managers&... m) : _managers(m...){};
+
+	// The code block takes the data of each resource manager as a separate
+	// argument, in order
+	template <class block>
+	With operator()(block&& code_block){
+		using data = typename _base::data_type;
+		constexpr bool nothrow = _nothrow_block<block>(_indices());
+		return _base::operator()([&](data* resources) noexcept(nothrow){
+			if (_nothrow_enter || !_skipped) {
+				std::apply(std::forward<block>(code_block), *resources);
+			}
+		});
+	}
+	With operator()(){
+		return _base::operator()();
+	}
+};
+
+// Groups several resource managers into a single context:
+//
+//		with { with_all(ResA(x), ResB(y))([&](auto a, auto b){ ... }) };
+//
+// The resource managers are neither copied nor moved, and the whole group
+// is entered and exited by one context rather than one per nesting level.
+template <class... resources>
+auto with_all(resources&&... r){
+	return All<std::remove_reference_t<decltype(ContextAccess::handle(r))>...>(ContextAccess::handle(r)...);
+}
+
+/********************************************
+*											*
+* 	Error values for contexts that do not	*
+*			use exceptions					*
+*											*
+********************************************/
+
+// Wraps an error so that it can be returned as an Expected
+template <class failure>
+class Unexpected {
+private:
+	failure _error;
+
+public:
+	explicit Unexpected(failure e) : _error(std::move(e)){};
+
+	const failure& value() const { return _error; }
+};
+
+template <class failure>
+Unexpected<std::decay_t<failure>> unexpected(failure&& e){
+	return Unexpected<std::decay_t<failure>>(std::forward<failure>(e));
+}
+
+// Either a value or an error, in the manner of std::expected. A default
+// constructed Expected holds a value-initialized value.
+template <class value_type, class failure = std::error_code>
+class Expected {
+private:
+	std::variant<value_type, failure> _outcome;
+
+public:
+	using error_type = failure;
+
+	Expected() = default;
+	Expected(value_type v) : _outcome(std::in_place_index<0>, std::move(v)){};
+	Expected(Unexpected<failure> e) : _outcome(std::in_place_index<1>, e.value()){};
+
+	bool has_value() const { return _outcome.index() == 0; }
+	explicit operator bool() const { return has_value(); }
+
+	value_type& value() & { return std::get<0>(_outcome); }
+	const value_type& value() const & { return std::get<0>(_outcome); }
+	value_type&& value() && { return std::get<0>(std::move(_outcome)); }
+	value_type& operator*() & { return *std::get_if<0>(&_outcome); }
+	const value_type& operator*() const & { return *std::get_if<0>(&_outcome); }
+	value_type* operator->() { return std::get_if<0>(&_outcome); }
+	const value_type* operator->() const { return std::get_if<0>(&_outcome); }
+
+	const failure& error() const { return *std::get_if<1>(&_outcome); }
+};
 
+template <class failure>
+class Expected<void, failure> {
+private:
+	failure _error{};
+	bool _has_value = true;
+
+public:
+	using error_type = failure;
+
+	Expected() = default;
+	Expected(Unexpected<failure> e) : _error(e.value()), _has_value(false){};
+
+	bool has_value() const { return _has_value; }
+	explicit operator bool() const { return has_value(); }
+
+	const failure& error() const { return _error; }
+};
+
+// Translates an exception escaping a code block into an error value.
+// Specialize it for error types other than std::error_code.
+template <class error>
+struct ErrorTraits;
+
+template <>
+struct ErrorTraits<std::error_code> {
+	static std::error_code from_exception(std::exception_ptr e){
+		try{
+			std::rethrow_exception(e);
+		} catch (const std::system_error& error) {
+			return error.code();
+		} catch (const std::bad_alloc&) {
+			return std::make_error_code(std::errc::not_enough_memory);
+		} catch (const std::invalid_argument&) {
+			return std::make_error_code(std::errc::invalid_argument);
+		} catch (const std::out_of_range&) {
+			return std::make_error_code(std::errc::result_out_of_range);
+		} catch (...) {
+			return std::make_error_code(std::errc::state_not_recoverable);
+		}
+	}
+};
+
+/********************************************
+*											*
+* 	The error value context manager			*
+*											*
+********************************************/
+
+// Runs a code block that reports failure by returning an Expected rather
+// than by throwing. The resource manager takes the error directly:
+//
+//		bool exit(const error& e);
+//
+// where a default-constructed error (an empty std::error_code) means the
+// block succeeded. As with exceptions, returning true handles the error and
+// with_expected returns a default-constructed Expected; otherwise the error
+// is returned to the caller. No exception machinery is involved unless the
+// code block can throw, in which case what it throws is translated through
+// ErrorTraits at this boundary. Being statically dispatched, exit(error) is
+// declared by a StaticResource or any class with enter and exit methods.
+template <class resource, class block>
+auto with_expected(resource&& r, block&& code_block){
+	auto& manager = ContextAccess::handle(r);
+	using result = std::invoke_result_t<block, decltype(ContextAccess::get(manager))>;
+	using error = typename result::error_type;
+
+	_probe_t<decltype(manager)> probe(manager);
+	ContextAccess::enter(manager);
+	probe.entered();
+	result outcome = [&]() -> result {
+		if constexpr (std::is_nothrow_invocable<block, decltype(ContextAccess::get(manager))>::value) {
+			return std::forward<block>(code_block)(ContextAccess::get(manager));
+		} else {
+			try{
+				return std::forward<block>(code_block)(ContextAccess::get(manager));
+			} catch (...) {
+				return unexpected(ErrorTraits<error>::from_exception(std::current_exception()));
+			}
+		}
+	}();
+	if (outcome) {
+		probe.finished();
+		ContextAccess::exit(manager, error{});
+		return outcome;
+	}
+	probe.failed();
+	if (ContextAccess::exit(manager, outcome.error())) {
+		return result();
+	}
+	return outcome;
 }
 
 };
@@ -0,0 +1,148 @@
+#ifndef CONTEXTUAL_ADAPTERS_H
+#define CONTEXTUAL_ADAPTERS_H
+
+#include <contextual.h>
+#include <optional>
+#include <tuple>
+
+/*
+
+Resource managers made without writing a class.
+
+make_resource builds one from a pair of functions, for the many resources
+whose enter and exit are a line each:
+
+	with {
+		make_resource(data,
+			[](IData* d){ std::swap(masked, d->password); },
+			[](IData* d){ std::swap(masked, d->password); }
+		)(
+			[&](IData* d){ ... }
+		)
+	};
+
+guard_resource adapts an existing RAII type, such as std::unique_lock,
+std::scoped_lock or a file handle: enter constructs it from the arguments
+and exit destroys it, and the code block receives a pointer to it:
+
+	with {
+		guard_resource<std::unique_lock<std::mutex>>(mutex)(
+			[&](std::unique_lock<std::mutex>* lock){ ... }
+		)
+	};
+
+Both are statically dispatched, so the functions and the guard's
+constructor and destructor are inlined into the context.
+
+*/
+
+namespace Contextual {
+
+/************************************
+*									*
+* 	Resource managers from a pair	*
+*			of functions			*
+*									*
+************************************/
+
+// The exit function takes the data and, optionally, the exception. If it
+// returns a bool that decides suppression as exit does; otherwise
+// exceptions propagate.
+template <class data, class enter_function, class exit_function, template <class> class storage>
+class LambdaResource : public StaticResource<LambdaResource<data, enter_function, exit_function, storage>,
+											 data, storage> {
+private:
+	friend struct ContextAccess;
+	using _base = StaticResource<LambdaResource<data, enter_function, exit_function, storage>, data, storage>;
+	static constexpr bool _takes_exception = std::is_invocable<exit_function&, data*, std::exception_ptr>::value;
+
+	enter_function _enter;
+	exit_function _exit;
+
+	void enter() noexcept(std::is_nothrow_invocable<enter_function&, data*>::value){
+		_enter(this->resources.get());
+	}
+
+	bool exit(std::exception_ptr e) noexcept(_takes_exception ?
+											 std::is_nothrow_invocable<exit_function&, data*, std::exception_ptr>::value :
+											 std::is_nothrow_invocable<exit_function&, data*>::value){
+		if constexpr (_takes_exception) {
+			if constexpr (std::is_same<std::invoke_result_t<exit_function&, data*, std::exception_ptr>, bool>::value) {
+				return _exit(this->resources.get(), e);
+			} else {
+				_exit(this->resources.get(), e);
+				return false;
+			}
+		} else {
+			if constexpr (std::is_same<std::invoke_result_t<exit_function&, data*>, bool>::value) {
+				return _exit(this->resources.get());
+			} else {
+				_exit(this->resources.get());
+				return false;
+			}
+		}
+	}
+
+public:
+	template <class resources, class enter_argument, class exit_argument>
+	LambdaResource(resources&& r, enter_argument&& enter, exit_argument&& exit) :
+		_base(std::forward<resources>(r)),
+		_enter(std::forward<enter_argument>(enter)),
+		_exit(std::forward<exit_argument>(exit)){};
+};
+
+// Borrows data passed by reference and takes ownership of a temporary
+template <class data, class enter_function, class exit_function>
+auto make_resource(data&& resources, enter_function&& enter, exit_function&& exit){
+	using stored = std::remove_cv_t<std::remove_reference_t<data>>;
+	if constexpr (std::is_lvalue_reference<data>::value) {
+		return LambdaResource<std::remove_reference_t<data>, std::decay_t<enter_function>,
+							  std::decay_t<exit_function>, Borrowed>(resources, std::forward<enter_function>(enter),
+																	 std::forward<exit_function>(exit));
+	} else {
+		return LambdaResource<stored, std::decay_t<enter_function>, std::decay_t<exit_function>, Owned>(
+			std::move(resources), std::forward<enter_function>(enter), std::forward<exit_function>(exit));
+	}
+}
+
+/************************************
+*									*
+* 	Resource managers from RAII		*
+*				types				*
+*									*
+************************************/
+
+template <class guard, class... args>
+class GuardResource : public StaticResource<GuardResource<guard, args...>, guard> {
+private:
+	friend struct ContextAccess;
+
+	// The constructor arguments, which live until the end of the with
+	// statement
+	std::tuple<args&&...> _arguments;
+	std::optional<guard> _guard;
+
+	void enter() noexcept(std::is_nothrow_constructible<guard, args&&...>::value){
+		std::apply([this](auto&&... arguments){
+			_guard.emplace(std::forward<decltype(arguments)>(arguments)...);
+		}, std::move(_arguments));
+		this->resources = &*_guard;
+	}
+
+	bool exit(std::exception_ptr e) noexcept(std::is_nothrow_destructible<guard>::value){
+		_guard.reset();
+		return false;
+	}
+
+public:
+	explicit GuardResource(args&&... arguments) : _arguments(std::forward<args>(arguments)...){};
+};
+
+template <class guard, class... args>
+GuardResource<guard, args...> guard_resource(args&&... arguments){
+	return GuardResource<guard, args...>(std::forward<args>(arguments)...);
+}
+
+};
+
+#endif
@@ -0,0 +1,358 @@
+#ifndef CONTEXTUAL_ALLOCATION_H
+#define CONTEXTUAL_ALLOCATION_H
+
+#include <contextual.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+
+/*
+
+Heap allocations of a code block, counted or forbidden.
+
+CountAllocations is a resource manager that counts the calls to the global
+operator new and delete its code block makes on its thread, the bytes it
+asks for, and the most it holds at once:
+
+	AllocationCounts counts;
+	with {
+		CountAllocations(counts)([&](AllocationCounts*){
+			...
+		})
+	};
+
+AllocationFree marks a code block that should not allocate at all. Every
+allocation inside it is a violation, handed to the violation handler,
+which by default writes it to stderr and aborts:
+
+	with {
+		AllocationFree("order book update")([&](AllocationCounts*){
+			...
+		})
+	};
+
+The handler is replaced with set_allocation_violation_handler, to log
+instead, or to throw std::bad_alloc from the allocation. It may allocate
+itself. The counts of an allocation-free block tell what got through.
+
+Both rely on replacements of the global operator new and delete, which a
+program defines by including this header in exactly one source file after
+defining CONTEXTUAL_ALLOCATION_IMPLEMENTATION:
+
+	#define CONTEXTUAL_ALLOCATION_IMPLEMENTATION
+	#include <contextual/allocation.h>
+
+Without them, nothing is counted and allocation_accounting() is false.
+Calls to malloc are not counted, as malloc offers no hooks anymore.
+
+The counts are of the calling thread: memory freed on another thread than
+the one that allocated it is not seen by the first. The most held at once
+is in the sizes the allocator rounded the requests up to.
+
+*/
+
+namespace Contextual {
+
+struct AllocationCounts {
+	// Calls to operator new and to operator delete
+	std::uint64_t allocations = 0;
+	std::uint64_t deallocations = 0;
+	// The bytes asked for
+	std::uint64_t bytes = 0;
+	// The most bytes held at once beyond what was held on entering
+	std::uint64_t peak = 0;
+};
+
+using AllocationViolationHandler = void (*)(const char* context, std::size_t size);
+
+/************************************
+*									*
+* 	Per-thread accounting			*
+*									*
+************************************/
+
+struct _AllocationState {
+	std::uint64_t allocations = 0;
+	std::uint64_t deallocations = 0;
+	std::uint64_t bytes = 0;
+	// Bytes allocated less those freed by this thread, and the most there
+	// were since the innermost counting context was entered
+	std::int64_t live = 0;
+	std::int64_t peak = 0;
+	// The innermost allocation-free context, if any
+	const char* forbidden = nullptr;
+};
+
+// Constant-initialized, so operator new can reach it without a guard, even
+// while the thread starts or exits
+inline thread_local _AllocationState _allocation_state;
+
+inline void _default_violation_handler(const char* context, std::size_t size){
+	// Without allocating, as the handler may be called from operator new
+	std::fprintf(stderr, "allocation of %zu bytes in allocation-free context %s\n", size, context);
+	std::abort();
+}
+
+inline std::atomic<AllocationViolationHandler>& _violation_handler(){
+	static std::atomic<AllocationViolationHandler> handler{&_default_violation_handler};
+	return handler;
+}
+
+// Set where the replacement operators are defined
+inline std::atomic<bool> _allocation_hooks{false};
+
+// Replaces the handler of allocations in allocation-free contexts,
+// returning the previous one
+inline AllocationViolationHandler set_allocation_violation_handler(AllocationViolationHandler handler){
+	return _violation_handler().exchange(handler ? handler : &_default_violation_handler);
+}
+
+// Whether operator new and delete are replaced, and so counted
+inline bool allocation_accounting(){
+	return _allocation_hooks.load(std::memory_order_relaxed);
+}
+
+// Everything the calling thread has allocated and freed since it started,
+// but for the peak, which only contexts keep
+inline AllocationCounts thread_allocations(){
+	const _AllocationState& state = _allocation_state;
+	return AllocationCounts{state.allocations, state.deallocations, state.bytes, 0};
+}
+
+inline std::size_t _allocated_size(void* p){
+#if defined(__APPLE__)
+	return malloc_size(p);
+#else
+	return malloc_usable_size(p);
+#endif
+}
+
+// Called by operator new before it allocates; the handler may throw
+inline void _before_allocation(std::size_t size){
+	_AllocationState& state = _allocation_state;
+	if (state.forbidden) {
+		const char* context = state.forbidden;
+		state.forbidden = nullptr;
+		try {
+			_violation_handler().load(std::memory_order_relaxed)(context, size);
+		} catch (...) {
+			state.forbidden = context;
+			throw;
+		}
+		state.forbidden = context;
+	}
+}
+
+inline void _after_allocation(void* p, std::size_t size){
+	_AllocationState& state = _allocation_state;
+	++state.allocations;
+	state.bytes += size;
+	state.live += static_cast<std::int64_t>(_allocated_size(p));
+	if (state.live > state.peak) {
+		state.peak = state.live;
+	}
+}
+
+inline void _before_deallocation(void* p){
+	if (p) {
+		_AllocationState& state = _allocation_state;
+		++state.deallocations;
+		state.live -= static_cast<std::int64_t>(_allocated_size(p));
+	}
+}
+
+/************************************
+*									*
+* 	The resource managers			*
+*									*
+************************************/
+
+// Where the thread's counts stood when a context was entered
+class _AllocationScope {
+private:
+	_AllocationState _start;
+
+public:
+	void enter(){
+		_AllocationState& state = _allocation_state;
+		_start = state;
+		state.peak = state.live;
+	}
+
+	void exit(AllocationCounts& counts){
+		_AllocationState& state = _allocation_state;
+		counts.allocations = state.allocations - _start.allocations;
+		counts.deallocations = state.deallocations - _start.deallocations;
+		counts.bytes = state.bytes - _start.bytes;
+		counts.peak = state.peak > _start.live ? static_cast<std::uint64_t>(state.peak - _start.live) : 0;
+		// The peak of the contexts this one is nested in
+		if (_start.peak > state.peak) {
+			state.peak = _start.peak;
+		}
+	}
+};
+
+// Neither of these is observed, as observers may allocate the first time
+// they see the contexts nested inside
+class CountAllocations : public StaticResource<CountAllocations, AllocationCounts> {
+private:
+	friend struct ContextAccess;
+
+	AllocationCounts _counts;
+	_AllocationScope _scope;
+
+	void enter() noexcept {
+		_scope.enter();
+	}
+
+	bool exit(std::exception_ptr e) noexcept {
+		_scope.exit(*resources);
+		return false;
+	}
+
+public:
+	CountAllocations() : StaticResource<CountAllocations, AllocationCounts>(_counts){};
+	// Puts the counts in counts too
+	explicit CountAllocations(AllocationCounts& counts)
+		: StaticResource<CountAllocations, AllocationCounts>(counts){};
+	// The block may hold a pointer to the counts inside
+	CountAllocations(const CountAllocations& other) = delete;
+
+	static constexpr Instrumentation instrumentation = Instrumentation::off;
+};
+
+// Counts the allocations of its code block too, so that the ones a
+// handler let through can be told
+class AllocationFree : public StaticResource<AllocationFree, AllocationCounts> {
+private:
+	friend struct ContextAccess;
+
+	const char* _name;
+	const char* _outer = nullptr;
+	AllocationCounts _counts;
+	_AllocationScope _scope;
+
+	void enter() noexcept {
+		_scope.enter();
+		_outer = _allocation_state.forbidden;
+		_allocation_state.forbidden = _name;
+	}
+
+	bool exit(std::exception_ptr e) noexcept {
+		_allocation_state.forbidden = _outer;
+		_scope.exit(*resources);
+		return false;
+	}
+
+public:
+	explicit AllocationFree(const char* name = "(unnamed)")
+		: StaticResource<AllocationFree, AllocationCounts>(_counts), _name(name){};
+	AllocationFree(AllocationCounts& counts, const char* name = "(unnamed)")
+		: StaticResource<AllocationFree, AllocationCounts>(counts), _name(name){};
+	AllocationFree(const AllocationFree& other) = delete;
+
+	static constexpr Instrumentation instrumentation = Instrumentation::off;
+};
+
+};
+
+#endif
+
+/************************************
+*									*
+* 	The replacement operators		*
+*									*
+************************************/
+
+#if defined(CONTEXTUAL_ALLOCATION_IMPLEMENTATION) && !defined(CONTEXTUAL_ALLOCATION_IMPLEMENTED)
+#define CONTEXTUAL_ALLOCATION_IMPLEMENTED
+
+namespace Contextual {
+
+	inline const bool _allocation_hooks_installed = (_allocation_hooks.store(true), true);
+
+	inline void* _allocate(std::size_t size, std::size_t alignment){
+		_before_allocation(size);
+		void* p = nullptr;
+		if (alignment <= alignof(std::max_align_t)) {
+			p = std::malloc(size ? size : 1);
+		} else if (posix_memalign(&p, alignment, size ? size : 1) != 0) {
+			p = nullptr;
+		}
+		if (!p) {
+			throw std::bad_alloc();
+		}
+		_after_allocation(p, size);
+		return p;
+	}
+
+	inline void* _allocate(std::size_t size, std::size_t alignment, const std::nothrow_t&) noexcept {
+		try {
+			return _allocate(size, alignment);
+		} catch (...) {
+			return nullptr;
+		}
+	}
+
+	inline void _deallocate(void* p) noexcept {
+		_before_deallocation(p);
+		std::free(p);
+	}
+
+};
+
+void* operator new(std::size_t size){
+	return Contextual::_allocate(size, alignof(std::max_align_t));
+}
+
+void* operator new[](std::size_t size){
+	return Contextual::_allocate(size, alignof(std::max_align_t));
+}
+
+void* operator new(std::size_t size, const std::nothrow_t& tag) noexcept {
+	return Contextual::_allocate(size, alignof(std::max_align_t), tag);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept {
+	return Contextual::_allocate(size, alignof(std::max_align_t), tag);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment){
+	return Contextual::_allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment){
+	return Contextual::_allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t& tag) noexcept {
+	return Contextual::_allocate(size, static_cast<std::size_t>(alignment), tag);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t& tag) noexcept {
+	return Contextual::_allocate(size, static_cast<std::size_t>(alignment), tag);
+}
+
+void operator delete(void* p) noexcept { Contextual::_deallocate(p); }
+void operator delete[](void* p) noexcept { Contextual::_deallocate(p); }
+void operator delete(void* p, std::size_t) noexcept { Contextual::_deallocate(p); }
+void operator delete[](void* p, std::size_t) noexcept { Contextual::_deallocate(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { Contextual::_deallocate(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { Contextual::_deallocate(p); }
+void operator delete(void* p, std::align_val_t) noexcept { Contextual::_deallocate(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { Contextual::_deallocate(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { Contextual::_deallocate(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { Contextual::_deallocate(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { Contextual::_deallocate(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { Contextual::_deallocate(p); }
+
+#endif
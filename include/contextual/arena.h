@@ -0,0 +1,243 @@
+#ifndef CONTEXTUAL_ARENA_H
+#define CONTEXTUAL_ARENA_H
+
+#include <contextual.h>
+#include <array>
+#include <cstddef>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <optional>
+
+/*
+
+An Arena is a resource manager for code blocks whose allocations are all
+thrown away at the end. Its data is a std::pmr::monotonic_buffer_resource,
+which hands out memory by bumping a pointer and frees nothing until the
+context exits, when it is released in one go:
+
+	with {
+		Arena<4096>()(
+			[&](std::pmr::memory_resource* arena){
+				std::pmr::vector<Row> rows(arena);
+				...
+			}
+		)
+	};
+
+The template argument is the size of a buffer kept inside the Arena, so on
+the stack when the Arena is, which is used before anything else.
+
+While the context is active the arena is also the thread's current memory
+resource, as returned by current_memory_resource(), and the previous one is
+restored on exit, so arenas nest. std::pmr::set_default_resource is shared
+by every thread, so it is only replaced as well when asked for with
+Arena(ArenaScope::process). Other threads may then allocate from the arena
+too, so such an arena takes a mutex around every allocation, the thread
+that entered it included, and its blocks come from the heap rather than
+that thread's cache. Whatever other threads allocated from it is freed
+with it on exit, all the same.
+
+The blocks an arena takes beyond its buffer come from a per-thread cache,
+ArenaBlockCache, that keeps them when the arena is released, so after the
+first few uses arenas do not touch the heap.
+
+*/
+
+namespace Contextual {
+
+/************************************
+*									*
+* 	The thread's memory resource	*
+*									*
+************************************/
+
+inline std::pmr::memory_resource*& _current_memory_resource(){
+	static thread_local std::pmr::memory_resource* current = nullptr;
+	return current;
+}
+
+// The innermost active arena on this thread, or std::pmr's default resource
+inline std::pmr::memory_resource* current_memory_resource(){
+	std::pmr::memory_resource* current = _current_memory_resource();
+	return current ? current : std::pmr::get_default_resource();
+}
+
+/************************************
+*									*
+* 	Recycled arena blocks			*
+*									*
+************************************/
+
+// A per-thread cache of freed arena blocks, in power of two size classes
+// from 1 KiB to 32 MiB. Larger or over-aligned blocks go straight to the heap.
+class ArenaBlockCache : public std::pmr::memory_resource {
+private:
+	static constexpr std::size_t _smallest = 10;
+	static constexpr std::size_t _classes = 16;
+	static constexpr std::size_t _cached_per_class = 4;
+
+	struct _Block {
+		_Block* next;
+	};
+
+	_Block* _free[_classes] = {};
+	std::size_t _count[_classes] = {};
+	std::size_t _allocations = 0;
+
+	static std::size_t _class(std::size_t bytes){
+		std::size_t c = 0;
+		while (c < _classes && (std::size_t(1) << (c + _smallest)) < bytes) {
+			++c;
+		}
+		return c;
+	}
+
+	static bool _cacheable(std::size_t c, std::size_t alignment){
+		return c < _classes && alignment <= alignof(std::max_align_t);
+	}
+
+	void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+		std::size_t c = _class(bytes);
+		if (_cacheable(c, alignment)) {
+			if (_Block* block = _free[c]) {
+				_free[c] = block->next;
+				--_count[c];
+				return block;
+			}
+			++_allocations;
+			return ::operator new(std::size_t(1) << (c + _smallest));
+		}
+		++_allocations;
+		return ::operator new(bytes, std::align_val_t(alignment));
+	}
+
+	void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+		std::size_t c = _class(bytes);
+		if (!_cacheable(c, alignment)) {
+			::operator delete(p, std::align_val_t(alignment));
+		} else if (_count[c] < _cached_per_class) {
+			_free[c] = ::new (p) _Block{_free[c]};
+			++_count[c];
+		} else {
+			::operator delete(p);
+		}
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+		return this == &other;
+	}
+
+public:
+	ArenaBlockCache() = default;
+	ArenaBlockCache(const ArenaBlockCache& other) = delete;
+	~ArenaBlockCache(){
+		for (std::size_t c = 0; c < _classes; ++c) {
+			while (_Block* block = _free[c]) {
+				_free[c] = block->next;
+				::operator delete(block);
+			}
+		}
+	}
+
+	static ArenaBlockCache& local(){
+		static thread_local ArenaBlockCache cache;
+		return cache;
+	}
+
+	// How many blocks this thread's cache has taken from the heap
+	std::size_t allocations() const { return _allocations; }
+};
+
+/************************************
+*									*
+* 	The arena resource manager		*
+*									*
+************************************/
+
+// Serializes the allocations of a resource that every thread may use
+class _SynchronizedResource : public std::pmr::memory_resource {
+private:
+	std::pmr::memory_resource* _resource;
+	std::mutex _mutex;
+
+protected:
+	void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+		std::lock_guard<std::mutex> hold(_mutex);
+		return _resource->allocate(bytes, alignment);
+	}
+
+	void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+		std::lock_guard<std::mutex> hold(_mutex);
+		_resource->deallocate(p, bytes, alignment);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+		return this == &other;
+	}
+
+public:
+	explicit _SynchronizedResource(std::pmr::memory_resource* resource) : _resource(resource){};
+	_SynchronizedResource(const _SynchronizedResource& other) = delete;
+};
+
+enum class ArenaScope {
+	// Only current_memory_resource() on this thread
+	thread,
+	// std::pmr::set_default_resource as well, with a mutex as any thread
+	// may allocate from it
+	process
+};
+
+template <std::size_t buffer_size = 0>
+class Arena : public StaticResource<Arena<buffer_size>, std::pmr::memory_resource> {
+private:
+	friend struct ContextAccess;
+
+	ArenaScope _scope;
+	alignas(std::max_align_t) std::array<std::byte, buffer_size> _buffer;
+	std::optional<std::pmr::monotonic_buffer_resource> _arena;
+	// In front of the arena for ArenaScope::process
+	std::optional<_SynchronizedResource> _synchronized;
+	std::pmr::memory_resource* _previous = nullptr;
+	std::pmr::memory_resource* _previous_default = nullptr;
+
+	void enter(){
+		// The thread's cache is not to be used by other threads
+		std::pmr::memory_resource* upstream = _scope == ArenaScope::process
+			? std::pmr::new_delete_resource() : &ArenaBlockCache::local();
+		if constexpr (buffer_size > 0) {
+			_arena.emplace(_buffer.data(), buffer_size, upstream);
+		} else {
+			_arena.emplace(upstream);
+		}
+		std::pmr::memory_resource* arena = &*_arena;
+		if (_scope == ArenaScope::process) {
+			arena = &_synchronized.emplace(arena);
+		}
+		this->resources = arena;
+		_previous = std::exchange(_current_memory_resource(), arena);
+		if (_scope == ArenaScope::process) {
+			_previous_default = std::pmr::set_default_resource(arena);
+		}
+	}
+
+	// Releases everything allocated in the context
+	bool exit(std::exception_ptr e) noexcept {
+		if (_scope == ArenaScope::process) {
+			std::pmr::set_default_resource(_previous_default);
+		}
+		_current_memory_resource() = _previous;
+		_synchronized.reset();
+		_arena.reset();
+		return false;
+	}
+
+public:
+	explicit Arena(ArenaScope scope=ArenaScope::thread) : _scope(scope){};
+	Arena(const Arena& other) = delete;
+};
+
+};
+
+#endif
@@ -0,0 +1,333 @@
+#ifndef CONTEXTUAL_COROUTINE_H
+#define CONTEXTUAL_COROUTINE_H
+
+#include <contextual.h>
+
+#if !defined(__cpp_impl_coroutine)
+#error "contextual/coroutine.h requires C++20 coroutines"
+#endif
+
+#include <condition_variable>
+#include <coroutine>
+#include <mutex>
+#include <optional>
+#include <variant>
+
+/*
+
+Asynchronous contexts on C++20 coroutines.
+
+With runs a context to completion inside its constructor, so a resource
+manager whose enter waits on I/O or a lock blocks the thread. co_with is its
+asynchronous counterpart: the resource manager's enter and exit are
+awaitables, and so is the code block, so one thread can keep many contexts
+in flight.
+
+	Task<int> handle(Request& request){
+		int n = co_await co_with(AsyncResource(request),
+			[&](auto resource) -> Task<int> {
+				...
+				co_return 42;
+			}
+		);
+	}
+
+An asynchronous resource manager declares, instead of enter and exit,
+
+	Awaitable async_enter();
+	Awaitable async_exit(std::exception_ptr e);	// the awaitable yields a bool
+
+with the same meaning as enter and exit. Like enter and exit, they are
+reached through ContextAccess and may be kept private. Deriving from
+StaticResource gives it storage for its data.
+
+Exit runs on every path out of the block. If the coroutine running co_with
+is destroyed while suspended inside the block, which is how coroutines are
+cancelled, the resource manager is moved into a detached coroutine that
+awaits async_exit with a Cancelled exception and then frees itself.
+
+*/
+
+namespace Contextual {
+
+// What async_exit receives when the context is destroyed before its code
+// block completes
+struct Cancelled : public std::exception {
+	const char* what() const noexcept override {
+		return "context cancelled";
+	}
+};
+
+template <class value = void>
+class Task;
+
+/************************************
+*									*
+* 	A lazily started coroutine		*
+*									*
+************************************/
+
+template <class value>
+class _TaskPromiseBase {
+public:
+	std::coroutine_handle<> continuation = std::noop_coroutine();
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+
+	// Resumes whoever awaited the task
+	struct _FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+		template <class promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<promise> finished) noexcept {
+			return finished.promise().continuation;
+		}
+		void await_resume() noexcept {}
+	};
+	_FinalAwaiter final_suspend() noexcept { return {}; }
+};
+
+template <class value>
+class _TaskPromise : public _TaskPromiseBase<value> {
+private:
+	std::variant<std::monostate, value, std::exception_ptr> _result;
+
+public:
+	Task<value> get_return_object() noexcept;
+
+	template <class result>
+	void return_value(result&& v){
+		_result.template emplace<1>(std::forward<result>(v));
+	}
+	void unhandled_exception() noexcept {
+		_result.template emplace<2>(std::current_exception());
+	}
+
+	value result(){
+		if (_result.index() == 2) {
+			std::rethrow_exception(std::get<2>(_result));
+		}
+		return std::move(std::get<1>(_result));
+	}
+};
+
+template <>
+class _TaskPromise<void> : public _TaskPromiseBase<void> {
+private:
+	std::exception_ptr _error;
+
+public:
+	Task<void> get_return_object() noexcept;
+
+	void return_void() noexcept {}
+	void unhandled_exception() noexcept {
+		_error = std::current_exception();
+	}
+
+	void result(){
+		if (_error) {
+			std::rethrow_exception(_error);
+		}
+	}
+};
+
+// A coroutine that starts when it is awaited and resumes its awaiter when
+// it completes. Destroying a Task that has not completed destroys the
+// suspended coroutine, cancelling it.
+template <class value>
+class Task {
+public:
+	using promise_type = _TaskPromise<value>;
+	using value_type = value;
+
+private:
+	std::coroutine_handle<promise_type> _handle;
+
+public:
+	explicit Task(std::coroutine_handle<promise_type> handle) : _handle(handle){};
+	Task(Task&& other) noexcept : _handle(std::exchange(other._handle, nullptr)){};
+	Task(const Task& other) = delete;
+	Task& operator=(Task other) noexcept {
+		std::swap(_handle, other._handle);
+		return *this;
+	}
+	~Task(){
+		if (_handle) {
+			_handle.destroy();
+		}
+	}
+
+	bool done() const { return !_handle || _handle.done(); }
+
+	// Starts the coroutine without awaiting it; it runs until it first
+	// suspends
+	void start(){
+		_handle.resume();
+	}
+
+	value result(){
+		return _handle.promise().result();
+	}
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+		_handle.promise().continuation = awaiting;
+		return _handle;
+	}
+	value await_resume(){
+		return _handle.promise().result();
+	}
+};
+
+template <class value>
+Task<value> _TaskPromise<value>::get_return_object() noexcept {
+	return Task<value>(std::coroutine_handle<_TaskPromise<value>>::from_promise(*this));
+}
+
+inline Task<void> _TaskPromise<void>::get_return_object() noexcept {
+	return Task<void>(std::coroutine_handle<_TaskPromise<void>>::from_promise(*this));
+}
+
+// Runs a task on the calling thread and blocks until it completes, for
+// when a synchronous caller needs its result
+template <class value>
+value sync_wait(Task<value> task){
+	struct _Signal {
+		std::mutex lock;
+		std::condition_variable changed;
+		bool done = false;
+	} signal;
+
+	struct _Notifier {
+		struct promise_type {
+			_Notifier get_return_object() noexcept { return {}; }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() noexcept {}
+			void unhandled_exception() noexcept {}
+		};
+	};
+
+	auto notify = [](Task<value>& task, _Signal& signal) -> _Notifier {
+		try{
+			co_await task;
+		} catch (...) {
+			// left in the task for result() to rethrow
+		}
+		std::lock_guard<std::mutex> hold(signal.lock);
+		signal.done = true;
+		signal.changed.notify_all();
+	};
+	notify(task, signal);
+
+	std::unique_lock<std::mutex> hold(signal.lock);
+	signal.changed.wait(hold, [&]{ return signal.done; });
+	return task.result();
+}
+
+/************************************
+*									*
+* 	The asynchronous context		*
+*			manager					*
+*									*
+************************************/
+
+template <class resource>
+struct _DetachedExit {
+	struct promise_type {
+		_DetachedExit get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept {}
+	};
+};
+
+// Awaits the exit of a resource manager whose context was cancelled,
+// keeping it alive until then
+template <class resource>
+_DetachedExit<resource> _exit_detached(resource r){
+	co_await ContextAccess::async_exit(ContextAccess::handle(r), std::make_exception_ptr(Cancelled()));
+}
+
+// Exits the resource manager if the coroutine is destroyed between a
+// successful enter and the start of exit
+template <class resource>
+class _CancelGuard {
+public:
+	resource& r;
+	bool armed = true;
+
+	~_CancelGuard(){
+		if (armed) {
+			_exit_detached(std::move(r));
+		}
+	}
+};
+
+template <class task>
+struct _TaskValue;
+
+template <class value>
+struct _TaskValue<Task<value>> {
+	using type = value;
+};
+
+// Runs a code block returning a Task with the resources of an asynchronous
+// resource manager, awaiting its async_enter and async_exit. The Task it
+// returns yields the value of the block. Exceptions are handled as by
+// With: async_exit sees what the block threw and decides whether it
+// propagates. The resource manager and the code block are moved into the
+// coroutine, so the Task may be awaited later.
+template <class resource, class block>
+auto co_with(resource r, block code_block)
+	-> Task<typename _TaskValue<std::invoke_result_t<block&, decltype(ContextAccess::get(ContextAccess::handle(r)))>>::type> {
+	using result = typename _TaskValue<std::invoke_result_t<block&, decltype(ContextAccess::get(ContextAccess::handle(r)))>>::type;
+
+	_async_probe_t<decltype(ContextAccess::handle(r))> probe(ContextAccess::handle(r));
+	co_await ContextAccess::async_enter(ContextAccess::handle(r));
+	probe.entered();
+	_CancelGuard<resource> guard{r};
+
+	std::exception_ptr error;
+	if constexpr (std::is_void<result>::value) {
+		try{
+			co_await code_block(ContextAccess::get(ContextAccess::handle(r)));
+			probe.finished();
+		} catch (...) {
+			error = std::current_exception();
+			probe.failed();
+		}
+		guard.armed = false;
+		bool suppressed = co_await ContextAccess::async_exit(ContextAccess::handle(r), error);
+		if (error && !suppressed) {
+			std::rethrow_exception(error);
+		}
+	} else {
+		std::optional<result> value;
+		try{
+			value.emplace(co_await code_block(ContextAccess::get(ContextAccess::handle(r))));
+			probe.finished();
+		} catch (...) {
+			error = std::current_exception();
+			probe.failed();
+		}
+		guard.armed = false;
+		bool suppressed = co_await ContextAccess::async_exit(ContextAccess::handle(r), error);
+		if (error && !suppressed) {
+			std::rethrow_exception(error);
+		}
+		if (!value) {
+			// exit suppressed the exception, as in with_result
+			if constexpr (std::is_default_constructible<result>::value) {
+				co_return result();
+			} else {
+				std::rethrow_exception(error);
+			}
+		}
+		co_return std::move(*value);
+	}
+}
+
+};
+
+#endif
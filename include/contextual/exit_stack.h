@@ -0,0 +1,274 @@
+#ifndef CONTEXTUAL_EXIT_STACK_H
+#define CONTEXTUAL_EXIT_STACK_H
+
+#include <contextual.h>
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+/*
+
+An ExitStack is a resource manager for contexts that only find out while
+running how many resources they need, in the manner of Python's
+contextlib.ExitStack. Its code block receives the stack itself, onto which
+it can enter further resource managers and register cleanup callbacks:
+
+	with {
+		ExitStack<>()(
+			[&](auto stack){
+				for (auto& shard : shards) {
+					stack->enter_context(ShardLock(shard));
+				}
+				stack->callback([&]{ ... });
+				...
+			}
+		)
+	};
+
+Everything pushed is unwound last-in first-out when the context exits,
+with the same chaining of exceptions as nested with blocks.
+
+Resource managers and callbacks moved onto the stack are kept in a buffer
+inside the ExitStack, as is the record of each entry, so as long as they
+fit, the first few entries never touch the heap. By default there is room
+for 8 entries and 512 bytes of resource managers; beyond that they spill to
+the heap. Both sizes have to be at least 1.
+
+*/
+
+namespace Contextual {
+
+template <std::size_t capacity = 8, std::size_t buffer_size = 512>
+class ExitStack : public StaticResource<ExitStack<capacity, buffer_size>,
+										ExitStack<capacity, buffer_size>> {
+private:
+	friend struct ContextAccess;
+	using _base = StaticResource<ExitStack<capacity, buffer_size>, ExitStack<capacity, buffer_size>>;
+
+	// Arrays of them are kept inline, and those cannot be empty
+	static_assert(capacity > 0, "an ExitStack needs room for at least one entry");
+	static_assert(buffer_size > 0, "an ExitStack needs a buffer of at least one byte");
+
+	struct _Entry {
+		void* object;
+		bool (*exit)(void* object, std::exception_ptr e);
+		// Null for resource managers owned by the caller
+		void (*destroy)(void* object, bool heap);
+		bool heap;
+	};
+
+	_Entry _entries[capacity];
+	std::vector<_Entry> _spilled;
+	std::size_t _size = 0;
+
+	alignas(std::max_align_t) unsigned char _buffer[buffer_size];
+	std::size_t _used = 0;
+
+	_Entry& _entry(std::size_t i){
+		return i < capacity ? _entries[i] : _spilled[i - capacity];
+	}
+
+	// Makes room for one more entry before anything is entered, so that
+	// pushing it cannot throw. The room grows geometrically, as push_back's
+	// would.
+	void _reserve(){
+		if (_size >= capacity && _spilled.size() == _spilled.capacity()) {
+			_spilled.reserve(std::max<std::size_t>(2 * _spilled.capacity(), capacity));
+		}
+	}
+
+	void _push(const _Entry& entry){
+		if (_size < capacity) {
+			_entries[_size] = entry;
+		} else {
+			_spilled.push_back(entry);
+		}
+		++_size;
+	}
+
+	// Room for an object of type T, from the buffer while it lasts
+	template <class T>
+	void* _allocate(bool& heap){
+		std::size_t offset = (_used + alignof(T) - 1) & ~(alignof(T) - 1);
+		if (alignof(T) <= alignof(std::max_align_t) && offset + sizeof(T) <= buffer_size) {
+			_used = offset + sizeof(T);
+			heap = false;
+			return _buffer + offset;
+		}
+		heap = true;
+		if constexpr (alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+			return ::operator new(sizeof(T), std::align_val_t(alignof(T)));
+		} else {
+			return ::operator new(sizeof(T));
+		}
+	}
+
+	template <class T>
+	static void _deallocate(void* object, bool heap){
+		if (heap) {
+			if constexpr (alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+				::operator delete(object, std::align_val_t(alignof(T)));
+			} else {
+				::operator delete(object);
+			}
+		}
+	}
+
+	// Constructs a T in the buffer or on the heap
+	template <class T, class... args>
+	T* _construct(bool& heap, args&&... arguments){
+		std::size_t used = _used;
+		void* memory = _allocate<T>(heap);
+		try{
+			return ::new (memory) T(std::forward<args>(arguments)...);
+		} catch (...) {
+			_deallocate<T>(memory, heap);
+			_used = used;
+			throw;
+		}
+	}
+
+	template <class T>
+	static void _destroy(void* object, bool heap){
+		static_cast<T*>(object)->~T();
+		_deallocate<T>(object, heap);
+	}
+
+	template <class resource>
+	static bool _exit_resource(void* object, std::exception_ptr e){
+		return ContextAccess::exit(ContextAccess::handle(*static_cast<resource*>(object)), e);
+	}
+
+	template <class function>
+	static bool _exit_callback(void* object, std::exception_ptr e){
+		(*static_cast<function*>(object))();
+		return false;
+	}
+
+	template <class function>
+	static bool _exit_push(void* object, std::exception_ptr e){
+		return (*static_cast<function*>(object))(e);
+	}
+
+	// Enters a resource manager already constructed at object and pushes it,
+	// or undoes its construction if enter throws
+	template <class resource>
+	auto _enter_owned(resource* object, bool heap, std::size_t used){
+		try{
+			ContextAccess::enter(ContextAccess::handle(*object));
+		} catch (...) {
+			_destroy<resource>(object, heap);
+			_used = used;
+			throw;
+		}
+		_push(_Entry{object, &_exit_resource<resource>, &_destroy<resource>, heap});
+		return ContextAccess::get(ContextAccess::handle(*object));
+	}
+
+	template <class function>
+	void _push_owned(function&& f, bool (*exit)(void*, std::exception_ptr)){
+		using stored = std::decay_t<function>;
+		bool heap;
+		stored* object = _construct<stored>(heap, std::forward<function>(f));
+		try{
+			_reserve();
+		} catch (...) {
+			_destroy<stored>(object, heap);
+			throw;
+		}
+		_push(_Entry{object, exit, &_destroy<stored>, heap});
+	}
+
+	void _reset(){
+		for (std::size_t i = _size; i-- > 0;) {
+			_Entry& entry = _entry(i);
+			if (entry.destroy) {
+				entry.destroy(entry.object, entry.heap);
+			}
+		}
+		_spilled.clear();
+		_size = 0;
+		_used = 0;
+	}
+
+	void enter(){}
+
+	// Unwinds the entries last-in first-out. Once one suppresses the
+	// exception the ones after it see none, and one that throws replaces the
+	// exception for the rest.
+	bool exit(std::exception_ptr e){
+		bool replaced = false;
+		for (std::size_t i = _size; i-- > 0;) {
+			_Entry& entry = _entry(i);
+			try{
+				if (entry.exit(entry.object, e)) {
+					e = nullptr;
+				}
+			} catch (...) {
+				e = std::current_exception();
+				replaced = true;
+			}
+		}
+		_reset();
+		if (replaced && e) {
+			std::rethrow_exception(e);
+		}
+		return !e;
+	}
+
+public:
+	ExitStack() : _base(this){};
+	ExitStack(const ExitStack& other) = delete;
+	ExitStack& operator=(const ExitStack& other) = delete;
+	~ExitStack(){
+		_reset();
+	}
+
+	// Enters a resource manager the caller keeps alive until the context
+	// exits, and returns its data
+	template <class resource>
+	auto enter_context(resource& r){
+		auto& manager = ContextAccess::handle(r);
+		_reserve();
+		ContextAccess::enter(manager);
+		_push(_Entry{&r, &_exit_resource<resource>, nullptr, false});
+		return ContextAccess::get(manager);
+	}
+
+	// Moves a resource manager onto the stack, enters it and returns its data
+	template <class resource, class = std::enable_if_t<!std::is_lvalue_reference<resource>::value>>
+	auto enter_context(resource&& r){
+		return emplace_context<resource>(std::move(r));
+	}
+
+	// Constructs a resource manager on the stack from the arguments, enters
+	// it and returns its data
+	template <class resource, class... args>
+	auto emplace_context(args&&... arguments){
+		_reserve();
+		std::size_t used = _used;
+		bool heap;
+		resource* object = _construct<resource>(heap, std::forward<args>(arguments)...);
+		return _enter_owned(object, heap, used);
+	}
+
+	// Registers a function taking no arguments to be called on exit
+	template <class function>
+	void callback(function&& f){
+		_push_owned(std::forward<function>(f), &_exit_callback<std::decay_t<function>>);
+	}
+
+	// Registers an exit function, called with the exception if any and
+	// returning true to suppress it
+	template <class function>
+	void push(function&& f){
+		_push_owned(std::forward<function>(f), &_exit_push<std::decay_t<function>>);
+	}
+
+	std::size_t size() const { return _size; }
+};
+
+};
+
+#endif
@@ -0,0 +1,245 @@
+#ifndef CONTEXTUAL_FOLDED_H
+#define CONTEXTUAL_FOLDED_H
+
+#include <contextual.h>
+#include <contextual/registry.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+
+Where the time of nested contexts goes, in the folded stack format that
+flamegraph.pl reads.
+
+FoldedStacks is a context observer that adds up, for each distinct path of
+nested contexts, the time spent in it including and excluding the contexts
+nested inside:
+
+	FoldedStacks& stacks = FoldedStacks::global();
+	...
+	std::ofstream out("contexts.folded");
+	stacks.dump(out);
+
+	$ flamegraph.pl contexts.folded > contexts.svg
+
+Each thread keeps its own trie of paths, whose nodes are only ever added,
+so however many contexts run, memory grows with the number of distinct
+paths. That is bounded too: contexts nested deeper than max_depth, or new
+paths once a thread has max_nodes of them, are counted as part of the
+context they are nested in.
+
+*/
+
+namespace Contextual {
+
+// The totals for one path of nested contexts, summed over all threads
+struct FoldedStack {
+	// The names of the contexts from the outermost, separated by ';'
+	std::string path;
+	std::uint64_t count = 0;
+	// Nanoseconds in the contexts of the path, with and without the contexts
+	// nested inside the last
+	std::uint64_t inclusive = 0;
+	std::uint64_t exclusive = 0;
+};
+
+class FoldedStacks : public ContextObserver {
+public:
+	static constexpr std::size_t max_depth = 64;
+	static constexpr std::size_t max_nodes = 4096;
+
+private:
+	struct _Totals {
+		std::uint64_t count = 0;
+		std::uint64_t inclusive = 0;
+		std::uint64_t children = 0;
+	};
+
+	// A node of a thread's trie. Its children are a list that only grows at
+	// the head, so other threads can walk it while the owner adds to it.
+	struct _Node {
+		const char* name;
+		_Node* parent;
+		_Node* sibling;
+		std::atomic<_Node*> child{nullptr};
+		std::atomic<std::uint64_t> count{0};
+		std::atomic<std::uint64_t> inclusive{0};
+	};
+
+	class _Tree {
+	public:
+		_Node root{nullptr, nullptr, nullptr};
+		_Node* current = &root;
+		std::size_t depth = 0;
+		std::size_t nodes = 0;
+		// Contexts that were not given a node, and whose end is to be ignored
+		std::size_t skipped = 0;
+
+		_Tree(){
+			FoldedStacks::global()._trees.add(*this);
+		}
+		_Tree(const _Tree& other) = delete;
+
+		// Keeps this thread's totals
+		~_Tree(){
+			FoldedStacks& stacks = FoldedStacks::global();
+			stacks._trees.remove(*this, [&]{
+				_add(stacks._retired, root, std::string());
+				_free(root);
+			});
+		}
+
+		static void _free(_Node& node){
+			_Node* child = node.child.load(std::memory_order_relaxed);
+			while (child) {
+				_free(*child);
+				_Node* sibling = child->sibling;
+				delete child;
+				child = sibling;
+			}
+		}
+
+		static _Tree& local(){
+			static thread_local _Tree tree;
+			return tree;
+		}
+
+		// The child of the current node for a name, found by its address, as
+		// names are interned and so outlive the contexts and the tree
+		_Node* find(const char* name){
+			_Node* first = current->child.load(std::memory_order_relaxed);
+			for (_Node* node = first; node; node = node->sibling) {
+				if (node->name == name) {
+					return node;
+				}
+			}
+			if (nodes == max_nodes) {
+				return nullptr;
+			}
+			++nodes;
+			_Node* created = new _Node{name, current, first};
+			current->child.store(created, std::memory_order_release);
+			return created;
+		}
+	};
+
+	_ThreadTables<_Tree> _trees;
+	// What threads that have exited recorded, and everything before the last
+	// reset, by path
+	std::map<std::string, _Totals> _retired;
+	std::map<std::string, _Totals> _baseline;
+
+	FoldedStacks(){
+		add_observer(*this);
+	}
+
+	// Adds the totals of a node's descendants to the paths below prefix
+	static void _add(std::map<std::string, _Totals>& totals, const _Node& node, const std::string& prefix){
+		for (_Node* child = node.child.load(std::memory_order_acquire); child; child = child->sibling) {
+			std::string name = readable_name(child->name);
+			std::replace(name.begin(), name.end(), ';', ':');
+			std::string path = prefix.empty() ? name : prefix + ";" + name;
+			_Totals& total = totals[path];
+			std::uint64_t inclusive = child->inclusive.load(std::memory_order_relaxed);
+			total.count += child->count.load(std::memory_order_relaxed);
+			total.inclusive += inclusive;
+			if (!prefix.empty()) {
+				totals[prefix].children += inclusive;
+			}
+			_add(totals, *child, path);
+		}
+	}
+
+	// Everything counted so far, by path; the caller holds the mutex
+	std::map<std::string, _Totals> _totals(){
+		std::map<std::string, _Totals> totals = _retired;
+		for (_Tree* tree : _trees.tables()) {
+			_add(totals, tree->root, std::string());
+		}
+		return totals;
+	}
+
+public:
+	FoldedStacks(const FoldedStacks& other) = delete;
+	~FoldedStacks(){
+		remove_observer(*this);
+	}
+
+	// The stacks of this process, which start recording on first use
+	static FoldedStacks& global(){
+		static FoldedStacks stacks;
+		return stacks;
+	}
+
+	void begin(const char* name) override {
+		_Tree& tree = _Tree::local();
+		// Contexts nested in one that was skipped are skipped too
+		_Node* node = !tree.skipped && tree.depth < max_depth ? tree.find(name) : nullptr;
+		if (!node) {
+			++tree.skipped;
+			return;
+		}
+		tree.current = node;
+		++tree.depth;
+	}
+
+	void end(const ContextSample& sample) override {
+		_Tree& tree = _Tree::local();
+		if (tree.skipped) {
+			--tree.skipped;
+			return;
+		}
+		if (tree.current == &tree.root) {
+			// begun before this observer was added
+			return;
+		}
+		_add_counter(tree.current->count, 1);
+		_add_counter(tree.current->inclusive, static_cast<std::uint64_t>(sample.end - sample.begin));
+		tree.current = tree.current->parent;
+		--tree.depth;
+	}
+
+	// Every path recorded since the last reset
+	std::vector<FoldedStack> snapshot(){
+		std::lock_guard<std::mutex> hold(_trees.mutex());
+		std::vector<FoldedStack> stacks;
+		for (auto& [path, total] : _totals()) {
+			_Totals before = _baseline[path];
+			FoldedStack stack;
+			stack.path = path;
+			stack.count = total.count - before.count;
+			stack.inclusive = total.inclusive - before.inclusive;
+			std::uint64_t children = total.children - before.children;
+			stack.exclusive = stack.inclusive > children ? stack.inclusive - children : 0;
+			if (stack.count) {
+				stacks.push_back(std::move(stack));
+			}
+		}
+		return stacks;
+	}
+
+	// Threads keep recording while this runs, so rather than clearing their
+	// tries it records where they stand and later snapshots subtract it
+	void reset(){
+		std::lock_guard<std::mutex> hold(_trees.mutex());
+		_baseline = _totals();
+	}
+
+	// Writes each path with its exclusive time in nanoseconds, one per line,
+	// as flamegraph.pl reads them
+	void dump(std::ostream& out){
+		for (const FoldedStack& stack : snapshot()) {
+			out << stack.path << ' ' << stack.exclusive << '\n';
+		}
+	}
+};
+
+};
+
+#endif
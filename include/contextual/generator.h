@@ -0,0 +1,217 @@
+#ifndef CONTEXTUAL_GENERATOR_H
+#define CONTEXTUAL_GENERATOR_H
+
+#include <contextual.h>
+
+#if !defined(__cpp_impl_coroutine)
+#error "contextual/generator.h requires C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <cstddef>
+#include <new>
+#include <stdexcept>
+
+/*
+
+Resource managers written as a single function, in the manner of Python's
+contextlib.contextmanager. Rather than a class with enter and exit, a
+coroutine returning a GeneratorResource does its setup, yields the data for
+the code block, and does its teardown after the yield:
+
+	GeneratorResource<FileData> opened(std::string path){
+		FileData file{std::fopen(path.c_str(), "r")};
+		try{
+			co_yield file;
+		} catch (std::system_error& e) {
+			// handled: the exception is suppressed
+		}
+		std::fclose(file.handle);
+	}
+
+	with { opened("log.txt")([&](FileData* file){ ... }) };
+
+Whatever the code block throws is rethrown at the co_yield. If the coroutine
+lets it escape, it propagates out of the context; if the coroutine catches
+it and finishes, it is suppressed; if the coroutine throws something else,
+that replaces it. The setup must yield exactly once.
+
+Coroutine frames come from a per-thread pool of recycled blocks, so after
+the first few uses a GeneratorResource does not allocate.
+
+*/
+
+namespace Contextual {
+
+/************************************
+*									*
+* 	Recycled coroutine frames		*
+*									*
+************************************/
+
+// A per-thread cache of freed coroutine frames, in size classes of 64
+// bytes. Frames larger than the largest class go straight to the heap.
+class FramePool {
+private:
+	static constexpr std::size_t _granularity = 64;
+	static constexpr std::size_t _classes = 32;
+	static constexpr std::size_t _cached_per_class = 16;
+
+	struct _Block {
+		_Block* next;
+	};
+
+	_Block* _free[_classes] = {};
+	std::size_t _count[_classes] = {};
+	std::size_t _allocations = 0;
+
+	static std::size_t _class(std::size_t size){
+		return (size + _granularity - 1) / _granularity - 1;
+	}
+
+public:
+	~FramePool(){
+		for (std::size_t c = 0; c < _classes; ++c) {
+			while (_Block* block = _free[c]) {
+				_free[c] = block->next;
+				::operator delete(block);
+			}
+		}
+	}
+
+	static FramePool& local(){
+		static thread_local FramePool pool;
+		return pool;
+	}
+
+	void* allocate(std::size_t size){
+		std::size_t c = _class(size);
+		if (c < _classes && _free[c]) {
+			_Block* block = _free[c];
+			_free[c] = block->next;
+			--_count[c];
+			return block;
+		}
+		++_allocations;
+		return ::operator new(c < _classes ? (c + 1) * _granularity : size);
+	}
+
+	void deallocate(void* p, std::size_t size) noexcept {
+		std::size_t c = _class(size);
+		if (c < _classes && _count[c] < _cached_per_class) {
+			_free[c] = ::new (p) _Block{_free[c]};
+			++_count[c];
+			return;
+		}
+		::operator delete(p);
+	}
+
+	// How many frames this thread's pool has taken from the heap
+	std::size_t allocations() const { return _allocations; }
+};
+
+/************************************
+*									*
+* 	The generator resource manager	*
+*									*
+************************************/
+
+template <class data>
+class GeneratorResource : public StaticResource<GeneratorResource<data>, data> {
+public:
+	class promise_type {
+	public:
+		data* yielded = nullptr;
+		// The exception from the code block, rethrown at the co_yield
+		std::exception_ptr injected;
+		// What escaped the coroutine
+		std::exception_ptr escaped;
+
+		static void* operator new(std::size_t size){
+			return FramePool::local().allocate(size);
+		}
+		static void operator delete(void* p, std::size_t size) noexcept {
+			FramePool::local().deallocate(p, size);
+		}
+
+		GeneratorResource get_return_object() noexcept {
+			return GeneratorResource(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept {
+			escaped = std::current_exception();
+		}
+
+		struct _YieldAwaiter {
+			promise_type& promise;
+			bool await_ready() noexcept { return false; }
+			void await_suspend(std::coroutine_handle<>) noexcept {}
+			void await_resume(){
+				if (promise.injected) {
+					std::rethrow_exception(std::exchange(promise.injected, nullptr));
+				}
+			}
+		};
+
+		_YieldAwaiter yield_value(data& resources) noexcept {
+			yielded = &resources;
+			return _YieldAwaiter{*this};
+		}
+	};
+
+private:
+	friend struct ContextAccess;
+	using _base = StaticResource<GeneratorResource<data>, data>;
+
+	std::coroutine_handle<promise_type> _handle;
+
+	explicit GeneratorResource(std::coroutine_handle<promise_type> handle) : _handle(handle){};
+
+	// Runs the setup up to the co_yield
+	void enter(){
+		_handle.resume();
+		promise_type& promise = _handle.promise();
+		if (promise.escaped) {
+			std::rethrow_exception(promise.escaped);
+		}
+		if (_handle.done()) {
+			throw std::logic_error("GeneratorResource did not yield");
+		}
+		this->resources = promise.yielded;
+	}
+
+	// Runs the teardown, with the exception from the code block rethrown at
+	// the co_yield
+	bool exit(std::exception_ptr e){
+		promise_type& promise = _handle.promise();
+		promise.injected = e;
+		_handle.resume();
+		if (!_handle.done()) {
+			throw std::logic_error("GeneratorResource yielded more than once");
+		}
+		if (!promise.escaped) {
+			// finished normally, so any exception was handled
+			return true;
+		}
+		if (promise.escaped == e) {
+			return false;
+		}
+		std::rethrow_exception(promise.escaped);
+	}
+
+public:
+	GeneratorResource(GeneratorResource&& other) noexcept : _base(std::move(other)),
+															 _handle(std::exchange(other._handle, nullptr)){};
+	GeneratorResource(const GeneratorResource& other) = delete;
+	~GeneratorResource(){
+		if (_handle) {
+			_handle.destroy();
+		}
+	}
+};
+
+};
+
+#endif
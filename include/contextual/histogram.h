@@ -0,0 +1,283 @@
+#ifndef CONTEXTUAL_HISTOGRAM_H
+#define CONTEXTUAL_HISTOGRAM_H
+
+#include <contextual.h>
+#include <contextual/registry.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+
+Latency histograms of contexts, per resource manager.
+
+LatencyHistograms is a context observer that records, for every context
+name, how long enter, the code block and exit took, how often exit was
+handed an exception and how often enter failed:
+
+	LatencyHistograms& latency = LatencyHistograms::global();
+	...
+	for (auto& context : latency.snapshot()) {
+		context.block.percentile(99.9);
+	}
+	latency.dump(std::cerr);
+
+Each phase is a log-linear histogram in the manner of HdrHistogram: exact
+below 32ns, then 32 buckets to every doubling, so any value is off by at
+most about 3%, up to half an hour.
+
+Each thread records into its own histograms, with plain stores; they are
+only added up when snapshot reads them. Under the sampled instrumentation
+policy the counts are of the contexts sampled. The histograms of a thread
+take some 28KB per context name, so a thread keeps them for max_names
+names at most, and records the contexts of any name beyond those under
+"(other contexts)".
+
+*/
+
+namespace Contextual {
+
+/************************************
+*									*
+* 	Log-linear histograms			*
+*									*
+************************************/
+
+class LatencyHistogram {
+public:
+	static constexpr unsigned sub_bits = 5;
+	static constexpr std::uint64_t sub_count = std::uint64_t(1) << sub_bits;
+	// Values of 2^41ns and more fall in the last bucket
+	static constexpr unsigned max_shift = 35;
+	static constexpr std::size_t bucket_count = (max_shift + 2) * sub_count;
+
+	static std::size_t bucket(std::uint64_t value){
+		if (value < sub_count) {
+			return static_cast<std::size_t>(value);
+		}
+		unsigned msb = 63 - static_cast<unsigned>(__builtin_clzll(value));
+		unsigned shift = msb - sub_bits;
+		if (shift > max_shift) {
+			return bucket_count - 1;
+		}
+		return static_cast<std::size_t>((shift + 1) * sub_count + (value >> shift) - sub_count);
+	}
+
+	// The largest value that falls in a bucket
+	static std::uint64_t highest(std::size_t bucket){
+		if (bucket < sub_count) {
+			return bucket;
+		}
+		unsigned shift = static_cast<unsigned>(bucket / sub_count) - 1;
+		std::uint64_t sub = bucket % sub_count + sub_count;
+		return ((sub + 1) << shift) - 1;
+	}
+
+private:
+	std::vector<std::uint64_t> _buckets = std::vector<std::uint64_t>(bucket_count);
+	std::uint64_t _count = 0;
+
+public:
+	void record(std::chrono::nanoseconds value){
+		add(bucket(static_cast<std::uint64_t>(std::max<std::int64_t>(value.count(), 0))), 1);
+	}
+
+	void add(std::size_t bucket, std::uint64_t n){
+		_buckets[bucket] += n;
+		_count += n;
+	}
+
+	void merge(const LatencyHistogram& other){
+		for (std::size_t i = 0; i < bucket_count; ++i) {
+			_buckets[i] += other._buckets[i];
+		}
+		_count += other._count;
+	}
+
+	void subtract(const LatencyHistogram& other){
+		for (std::size_t i = 0; i < bucket_count; ++i) {
+			_buckets[i] -= other._buckets[i];
+		}
+		_count -= other._count;
+	}
+
+	std::uint64_t count() const { return _count; }
+
+	// The value that p percent of the recorded values are at or below,
+	// for p from 0 to 100
+	std::chrono::nanoseconds percentile(double p) const {
+		if (_count == 0) {
+			return std::chrono::nanoseconds(0);
+		}
+		std::uint64_t rank = static_cast<std::uint64_t>(std::ceil(std::clamp(p, 0.0, 100.0) / 100.0 * _count));
+		rank = std::max<std::uint64_t>(rank, 1);
+		std::uint64_t seen = 0;
+		for (std::size_t i = 0; i < bucket_count; ++i) {
+			seen += _buckets[i];
+			if (seen >= rank) {
+				return std::chrono::nanoseconds(highest(i));
+			}
+		}
+		return std::chrono::nanoseconds(highest(bucket_count - 1));
+	}
+
+	std::chrono::nanoseconds max() const {
+		return percentile(100.0);
+	}
+};
+
+// A histogram written by one thread and read by others
+class _ThreadHistogram {
+private:
+	std::atomic<std::uint64_t> _buckets[LatencyHistogram::bucket_count] = {};
+
+public:
+	void record(std::int64_t nanoseconds){
+		auto& counter = _buckets[LatencyHistogram::bucket(static_cast<std::uint64_t>(std::max<std::int64_t>(nanoseconds, 0)))];
+		counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	void add_to(LatencyHistogram& total) const {
+		for (std::size_t i = 0; i < LatencyHistogram::bucket_count; ++i) {
+			if (std::uint64_t n = _buckets[i].load(std::memory_order_relaxed)) {
+				total.add(i, n);
+			}
+		}
+	}
+};
+
+/************************************
+*									*
+* 	Histograms per context name		*
+*									*
+************************************/
+
+// Everything recorded for one context name, summed over all threads
+struct LatencySnapshot {
+	std::string name;
+	LatencyHistogram enter;
+	LatencyHistogram block;
+	LatencyHistogram exit;
+	// How often exit was handed an exception
+	std::uint64_t exceptions = 0;
+	// How often enter threw; those contexts are only in the enter histogram
+	std::uint64_t enter_failures = 0;
+
+	std::uint64_t count() const { return enter.count(); }
+
+	void merge(const LatencySnapshot& other){
+		enter.merge(other.enter);
+		block.merge(other.block);
+		exit.merge(other.exit);
+		exceptions += other.exceptions;
+		enter_failures += other.enter_failures;
+	}
+
+	void subtract(const LatencySnapshot& other){
+		enter.subtract(other.enter);
+		block.subtract(other.block);
+		exit.subtract(other.exit);
+		exceptions -= other.exceptions;
+		enter_failures -= other.enter_failures;
+	}
+};
+
+// One thread's histograms for one context name
+struct _LatencyCounts {
+	_ThreadHistogram enter;
+	_ThreadHistogram block;
+	_ThreadHistogram exit;
+	std::atomic<std::uint64_t> exceptions{0};
+	std::atomic<std::uint64_t> enter_failures{0};
+
+	void add_to(LatencySnapshot& total) const {
+		enter.add_to(total.enter);
+		block.add_to(total.block);
+		exit.add_to(total.exit);
+		total.exceptions += exceptions.load(std::memory_order_relaxed);
+		total.enter_failures += enter_failures.load(std::memory_order_relaxed);
+	}
+};
+
+class LatencyHistograms : public _NamedStatistics<LatencyHistograms, _LatencyCounts, LatencySnapshot>,
+						  public ContextObserver {
+public:
+	static constexpr std::size_t max_names = 256;
+	static constexpr const char* overflow_name = other_contexts;
+	// Context names come to observers interned
+	static constexpr bool interned_names = true;
+
+private:
+	LatencyHistograms(){
+		add_observer(*this);
+	}
+
+public:
+	LatencyHistograms(const LatencyHistograms& other) = delete;
+	~LatencyHistograms(){
+		remove_observer(*this);
+	}
+
+	// The histograms of this process, which start recording on first use
+	static LatencyHistograms& global(){
+		static LatencyHistograms histograms;
+		return histograms;
+	}
+
+	void end(const ContextSample& sample) override {
+		_LatencyCounts& counts = _Table::local().slot(sample.name).values;
+		counts.enter.record(sample.entered - sample.begin);
+		if (sample.enter_failed) {
+			_add_counter(counts.enter_failures, 1);
+			return;
+		}
+		counts.block.record(sample.finished - sample.entered);
+		counts.exit.record(sample.end - sample.finished);
+		if (sample.exception) {
+			_add_counter(counts.exceptions, 1);
+		}
+	}
+
+	// Every context name recorded since the last reset
+	std::vector<LatencySnapshot> snapshot(){
+		std::map<std::string, LatencySnapshot> named;
+		for (auto& [site, total] : since_reset()) {
+			// Sites are by the name the contexts gave, which for types is
+			// mangled, and different mangled names can read the same
+			std::string name = readable_name(site->name.c_str());
+			LatencySnapshot& merged = named[name];
+			merged.name = name;
+			merged.merge(total);
+		}
+		std::vector<LatencySnapshot> snapshots;
+		for (auto& [name, total] : named) {
+			snapshots.push_back(std::move(total));
+		}
+		return snapshots;
+	}
+
+	// A table of percentiles per context name and phase, in nanoseconds
+	void dump(std::ostream& out){
+		out << "context\tphase\tcount\tp50\tp90\tp99\tp99.9\tmax\texceptions\n";
+		for (const LatencySnapshot& s : snapshot()) {
+			const std::pair<const char*, const LatencyHistogram*> phases[] = {
+				{"enter", &s.enter}, {"block", &s.block}, {"exit", &s.exit}
+			};
+			for (auto& [phase, h] : phases) {
+				out << s.name << '\t' << phase << '\t' << h->count() << '\t' << h->percentile(50).count() << '\t'
+					<< h->percentile(90).count() << '\t' << h->percentile(99).count() << '\t'
+					<< h->percentile(99.9).count() << '\t' << h->max().count() << '\t' << s.exceptions << '\n';
+			}
+		}
+	}
+};
+
+};
+
+#endif
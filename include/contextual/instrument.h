@@ -0,0 +1,577 @@
+#ifndef CONTEXTUAL_INSTRUMENT_H
+#define CONTEXTUAL_INSTRUMENT_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <unordered_set>
+#include <utility>
+
+#if __has_include(<cxxabi.h>)
+#include <cxxabi.h>
+#include <cstdlib>
+#endif
+
+/*
+
+The hook through which contexts can be observed.
+
+When instrumentation is on, each context times its enter, its code block
+and its exit, and hands the result to the observers that have been added.
+That goes for contexts run by With, with_result, with_expected and co_with,
+and for each of the resource managers of with_all:
+
+	class SlowContexts : public ContextObserver {
+		void end(const ContextSample& sample) override { ... }
+	};
+
+	SlowContexts slow;
+	add_observer(slow);
+
+Contexts are named by their resource manager: by its context_name() if it
+has a public one, otherwise by its type. The name only has to last until
+the context starts, as observers are given a copy interned for the life of
+the process, so that they can keep it and compare names by address. Up to
+max_context_names distinct names are kept; contexts named otherwise after
+that are all observed as "(other contexts)". Observers are called on the
+thread running the context, so they should record into per-thread storage
+rather than share anything.
+
+How much is observed is a policy chosen at compile time:
+
+	off			nothing; the default
+	sampled		1 in CONTEXTUAL_SAMPLE_EVERY outermost contexts on each
+				thread, 64 unless defined otherwise, with every context
+				nested inside them; set with CONTEXTUAL_INSTRUMENT_SAMPLED
+	full		every context; set with CONTEXTUAL_INSTRUMENT
+
+Under the off policy the hook compiles to nothing, and a context is exactly
+as it would be without this header. Otherwise, while there are no
+observers, a context costs one relaxed load more, and a context that is not
+sampled a thread-local countdown. A resource manager can choose its own
+policy, higher or lower than the default, for instance to leave out one
+whose contexts are too cheap to time, or to observe just one kind of
+context in a program built without instrumentation:
+
+	static constexpr Instrumentation instrumentation = Instrumentation::off;
+
+That goes for resource managers given by their own type; an IResource is
+observed under the default policy.
+
+Resource managers that keep statistics of their own follow the same policy
+by asking context_observed() whether the thread is inside an observed
+context.
+
+*/
+
+namespace Contextual {
+
+/************************************
+*									*
+* 	Observers						*
+*									*
+************************************/
+
+// What an observer learns about one context. Times are steady_clock
+// nanoseconds.
+struct ContextSample {
+	// Interned, so equal names have the same address
+	const char* name = nullptr;
+	// Before enter
+	std::int64_t begin = 0;
+	// After enter, or when it threw
+	std::int64_t entered = 0;
+	// When the code block returned or threw
+	std::int64_t finished = 0;
+	// After exit
+	std::int64_t end = 0;
+	// Enter threw, so the code block and exit never ran
+	bool enter_failed = false;
+	// Exit was handed an exception from the code block
+	bool exception = false;
+};
+
+class ContextObserver {
+public:
+	virtual ~ContextObserver() = default;
+
+	// Before the resource manager is entered
+	virtual void begin(const char* name){}
+
+	// Once the context is over, however it ended. It may be called while an
+	// exception propagates, so it must not throw.
+	virtual void end(const ContextSample& sample) = 0;
+};
+
+class _Observers {
+private:
+	static constexpr std::size_t _capacity = 8;
+
+	std::atomic<ContextObserver*> _observers[_capacity] = {};
+	std::atomic<std::size_t> _count{0};
+
+public:
+	static _Observers& global(){
+		static _Observers observers;
+		return observers;
+	}
+
+	bool active() const {
+		return _count.load(std::memory_order_relaxed) != 0;
+	}
+
+	bool add(ContextObserver& observer){
+		for (auto& slot : _observers) {
+			ContextObserver* empty = nullptr;
+			if (slot.compare_exchange_strong(empty, &observer, std::memory_order_acq_rel)) {
+				_count.fetch_add(1, std::memory_order_relaxed);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void remove(ContextObserver& observer){
+		for (auto& slot : _observers) {
+			ContextObserver* expected = &observer;
+			if (slot.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel)) {
+				_count.fetch_sub(1, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	template <class function>
+	void each(function&& call){
+		for (auto& slot : _observers) {
+			if (ContextObserver* observer = slot.load(std::memory_order_acquire)) {
+				call(*observer);
+			}
+		}
+	}
+};
+
+// Adds an observer of every context on every thread; there is room for 8.
+// Returns false if they are all taken.
+inline bool add_observer(ContextObserver& observer){
+	return _Observers::global().add(observer);
+}
+
+// A context already running may still call an observer after it has been
+// removed, so it should outlive them
+inline void remove_observer(ContextObserver& observer){
+	_Observers::global().remove(observer);
+}
+
+/************************************
+*									*
+* 	Names of contexts				*
+*									*
+************************************/
+
+template <class resource, class = void>
+struct _HasContextName : std::false_type {};
+
+template <class resource>
+struct _HasContextName<resource, std::void_t<decltype(std::declval<const resource&>().context_name())>>
+	: std::true_type {};
+
+// The name a context is observed under, which only has to last until the
+// context has started
+template <class resource>
+const char* context_name(const resource& r){
+	if constexpr (_HasContextName<resource>::value) {
+		return r.context_name();
+	} else {
+		return typeid(r).name();
+	}
+}
+
+inline constexpr std::size_t max_context_names = 4096;
+
+// What contexts with a name beyond the first max_context_names are observed
+// as
+inline constexpr const char* other_contexts = "(other contexts)";
+
+// Every context name observed, each kept once, as the names the resource
+// managers give may be built on the fly and gone once their context is
+class _ContextNames {
+private:
+	std::mutex _mutex;
+	// Whose nodes, and so whose strings, never move
+	std::unordered_set<std::string> _names;
+
+public:
+	static _ContextNames& global(){
+		static _ContextNames names;
+		return names;
+	}
+
+	const char* intern(const char* name){
+		std::lock_guard<std::mutex> hold(_mutex);
+		auto found = _names.find(name);
+		if (found != _names.end()) {
+			return found->c_str();
+		}
+		if (_names.size() == max_context_names) {
+			return other_contexts;
+		}
+		return _names.emplace(name).first->c_str();
+	}
+};
+
+// The names a thread interned last, by the address they were given at, so
+// that the shared set is only locked for a name new to the thread. As that
+// address may since hold another name, a hit is checked against the text.
+struct _NameCache {
+	static constexpr std::size_t size = 64;
+
+	const char* given[size] = {};
+	const char* interned[size] = {};
+
+	const char* intern(const char* name){
+		std::size_t i = (reinterpret_cast<std::uintptr_t>(name) >> 3) % size;
+		if (given[i] == name && std::strcmp(interned[i], name) == 0) {
+			return interned[i];
+		}
+		const char* kept = _ContextNames::global().intern(name);
+		if (kept != other_contexts) {
+			given[i] = name;
+			interned[i] = kept;
+		}
+		return kept;
+	}
+};
+
+// Constant-initialized, so reaching it needs no guard
+inline thread_local _NameCache _name_cache;
+
+// The copy of a context name that observers are given, which lasts as long
+// as the process. Equal names give the same copy.
+inline const char* intern_context_name(const char* name){
+	return _name_cache.intern(name);
+}
+
+// A context name as a person would write it, demangling type names where
+// the compiler allows
+inline std::string readable_name(const char* name){
+#if __has_include(<cxxabi.h>)
+	int status = 0;
+	char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+	if (status == 0 && demangled) {
+		std::string readable(demangled);
+		std::free(demangled);
+		return readable;
+	}
+#endif
+	return name;
+}
+
+/************************************
+*									*
+* 	Instrumentation policies		*
+*									*
+************************************/
+
+enum class Instrumentation {
+	off,
+	sampled,
+	full
+};
+
+#ifndef CONTEXTUAL_SAMPLE_EVERY
+#define CONTEXTUAL_SAMPLE_EVERY 64
+#endif
+
+#if defined(CONTEXTUAL_INSTRUMENT_SAMPLED)
+inline constexpr Instrumentation default_instrumentation = Instrumentation::sampled;
+#elif defined(CONTEXTUAL_INSTRUMENT)
+inline constexpr Instrumentation default_instrumentation = Instrumentation::full;
+#else
+inline constexpr Instrumentation default_instrumentation = Instrumentation::off;
+#endif
+
+// The policy of a resource manager: its own instrumentation member if it
+// has one, the default otherwise
+template <class resource, class = void>
+struct instrumentation_of {
+	static constexpr Instrumentation value = default_instrumentation;
+};
+
+template <class resource>
+struct instrumentation_of<resource, std::void_t<decltype(resource::instrumentation)>> {
+	static constexpr Instrumentation value = resource::instrumentation;
+};
+
+// Decides which contexts of a thread are sampled. Only the outermost
+// sampled-policy context counts down; those nested in it follow its lead.
+struct _Sampler {
+	std::uint32_t countdown = 1;
+	std::uint32_t depth = 0;
+	bool sampling = false;
+
+	static std::atomic<std::uint32_t>& every(){
+		static std::atomic<std::uint32_t> n{CONTEXTUAL_SAMPLE_EVERY};
+		return n;
+	}
+
+	bool enter(){
+		if (depth++ == 0) {
+			std::uint32_t n = every().load(std::memory_order_relaxed);
+			if (n == 0) {
+				sampling = false;
+			} else {
+				countdown = countdown < n ? countdown : n;
+				sampling = --countdown == 0;
+				if (sampling) {
+					countdown = n;
+				}
+			}
+		}
+		return sampling;
+	}
+
+	void exit(){
+		--depth;
+	}
+};
+
+// Constant-initialized, so reaching it needs no guard
+inline thread_local _Sampler _sampler;
+
+// Samples 1 in n outermost contexts of the sampled policy from now on; 0
+// samples none
+inline void set_sample_every(std::uint32_t n){
+	_Sampler::every().store(n, std::memory_order_relaxed);
+}
+
+/************************************
+*									*
+* 	The probe in contexts			*
+*									*
+************************************/
+
+inline std::int64_t _instrument_now(){
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Whether the thread is inside an observed context, for resource managers
+// that keep statistics of their own, as named locks do, to keep them by the
+// same policy
+inline thread_local bool _observing = false;
+
+inline bool context_observed(){
+	return _observing;
+}
+
+// Marks the phases of a context and reports it to the observers when ended,
+// by end or on destruction, however the context ends. While there are no
+// observers it does no more than check for them, and what it does otherwise
+// is kept out of line so that it does not get in the way of inlining the
+// context. A probe may be begun again once it has ended.
+template <Instrumentation policy>
+class _ContextProbe {
+private:
+	ContextSample _sample;
+	bool _active = false;
+	// Counted by the sampler, and so to be uncounted
+	bool _counted = false;
+	bool _outer_observing = false;
+
+	static void _begin(ContextSample& sample, const char* name);
+	static void _end(ContextSample& sample);
+
+public:
+	_ContextProbe() = default;
+	template <class resource>
+	explicit _ContextProbe(const resource& r){
+		begin(r);
+	}
+	_ContextProbe(const _ContextProbe& other) = delete;
+	_ContextProbe& operator=(const _ContextProbe& other) = delete;
+
+	~_ContextProbe(){
+		end();
+	}
+
+	// Before the resource manager is entered
+	template <class resource>
+	void begin(const resource& r){
+		if (_Observers::global().active()) {
+			if constexpr (policy == Instrumentation::sampled) {
+				_counted = true;
+				_active = _sampler.enter();
+			} else {
+				_active = true;
+			}
+			if (_active) {
+				_sample = ContextSample();
+				_outer_observing = _observing;
+				_observing = true;
+				_begin(_sample, context_name(r));
+			}
+		}
+	}
+
+	// Once the resource manager is exited, or failed to enter
+	void end(){
+		if constexpr (policy == Instrumentation::sampled) {
+			if (_counted) {
+				_counted = false;
+				_sampler.exit();
+			}
+		}
+		if (_active) {
+			_active = false;
+			_observing = _outer_observing;
+			_end(_sample);
+		}
+	}
+
+	void entered(){
+		if (_active) {
+			_sample.entered = _instrument_now();
+		}
+	}
+
+	void finished(){
+		if (_active) {
+			_sample.finished = _instrument_now();
+		}
+	}
+
+	void failed(){
+		if (_active) {
+			_sample.finished = _instrument_now();
+			_sample.exception = true;
+		}
+	}
+};
+
+// Under the off policy it is not there at all
+template <>
+class _ContextProbe<Instrumentation::off> {
+public:
+	_ContextProbe() = default;
+	template <class resource>
+	explicit _ContextProbe(const resource& r){}
+	_ContextProbe(const _ContextProbe& other) = delete;
+	_ContextProbe& operator=(const _ContextProbe& other) = delete;
+
+	template <class resource>
+	void begin(const resource& r){}
+	void end(){}
+	void entered(){}
+	void finished(){}
+	void failed(){}
+};
+
+// The probe of a context of a resource manager, by its policy
+template <class resource>
+using _probe_t = _ContextProbe<instrumentation_of<std::remove_cv_t<std::remove_reference_t<resource>>>::value>;
+
+// The probe of a context of co_with, which may move to another thread each
+// time it waits. Nothing of it is left on the thread in the meantime: it
+// is reported whole once it is over, to the observers on the thread it
+// ends on, as a context with nothing nested inside.
+template <Instrumentation policy>
+class _AsyncProbe {
+private:
+	ContextSample _sample;
+	bool _active = false;
+
+public:
+	template <class resource>
+	explicit _AsyncProbe(const resource& r){
+		if constexpr (policy != Instrumentation::off) {
+			if (_Observers::global().active()) {
+				if constexpr (policy == Instrumentation::sampled) {
+					_active = _sampler.enter();
+					_sampler.exit();
+				} else {
+					_active = true;
+				}
+				if (_active) {
+					_sample.name = intern_context_name(context_name(r));
+					_sample.begin = _instrument_now();
+				}
+			}
+		}
+	}
+	_AsyncProbe(const _AsyncProbe& other) = delete;
+	_AsyncProbe& operator=(const _AsyncProbe& other) = delete;
+
+	~_AsyncProbe(){
+		if (_active) {
+			_sample.end = _instrument_now();
+			if (!_sample.entered) {
+				_sample.enter_failed = true;
+				_sample.entered = _sample.finished = _sample.end;
+			} else if (!_sample.finished) {
+				// Cancelled while it waited
+				_sample.finished = _sample.end;
+			}
+			_Observers::global().each([&](ContextObserver& observer){
+				observer.begin(_sample.name);
+				observer.end(_sample);
+			});
+		}
+	}
+
+	void entered(){
+		if (_active) {
+			_sample.entered = _instrument_now();
+		}
+	}
+
+	void finished(){
+		if (_active) {
+			_sample.finished = _instrument_now();
+		}
+	}
+
+	void failed(){
+		if (_active) {
+			_sample.finished = _instrument_now();
+			_sample.exception = true;
+		}
+	}
+};
+
+template <class resource>
+using _async_probe_t = _AsyncProbe<instrumentation_of<std::remove_cv_t<std::remove_reference_t<resource>>>::value>;
+
+template <Instrumentation policy>
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void _ContextProbe<policy>::_begin(ContextSample& sample, const char* name){
+	name = intern_context_name(name);
+	sample.name = name;
+	_Observers::global().each([&](ContextObserver& observer){ observer.begin(name); });
+	sample.begin = _instrument_now();
+}
+
+template <Instrumentation policy>
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void _ContextProbe<policy>::_end(ContextSample& sample){
+	sample.end = _instrument_now();
+	if (!sample.entered) {
+		sample.enter_failed = true;
+		sample.entered = sample.finished = sample.end;
+	}
+	_Observers::global().each([&](ContextObserver& observer){ observer.end(sample); });
+}
+
+};
+
+
+#endif
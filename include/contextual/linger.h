@@ -0,0 +1,289 @@
+#ifndef CONTEXTUAL_LINGER_H
+#define CONTEXTUAL_LINGER_H
+
+#include <contextual.h>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <typeindex>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+/*
+
+Resources kept acquired across consecutive contexts that use them.
+
+Some resource managers have an expensive enter and exit, attaching shared
+memory or opening a file, for a resource that the same thread uses again
+moments later. linger makes a resource manager whose resource stays
+acquired after the context, in a cache of the thread, so that a following
+context with the same key skips the real enter and exit:
+
+	with {
+		linger(path, [&]{ return SharedMemory(path); })(
+			[&](Segment* segment){ ... }
+		)
+	};
+
+The function makes the resource manager, and is only called when there is
+nothing lingering under the key for that type of resource manager. How
+long a resource lingers is set by a LingerPolicy: for a time after its
+last context, for a number of contexts, and for at most a number of
+resources of its type of resource manager per thread, the least recently
+used of that type being released first. Lingering resources of other types
+are left alone, as their policies may allow more. The
+real exit happens when one of those runs out, when the thread exits, or
+on flush_lingering(). A resource past its time is only released by the
+next lingering context on its thread, or by a flush, as nothing else runs
+on the thread to notice.
+
+A code block that throws has its resource released at once, with the
+exception, as it may have been left in any state. A deferred exit has no
+code block to throw to, so its exceptions are ignored.
+
+*/
+
+namespace Contextual {
+
+struct LingerPolicy {
+	// How long a resource stays acquired after its last context
+	std::chrono::nanoseconds time = std::chrono::milliseconds(10);
+	// How many contexts use it before it is released, 0 for no limit
+	std::size_t uses = 0;
+	// How many resources of the same type of resource manager a thread
+	// keeps lingering at most
+	std::size_t capacity = 16;
+};
+
+/************************************
+*									*
+* 	The per-thread cache			*
+*									*
+************************************/
+
+// A resource manager that was entered, and not exited yet
+class _Lingering {
+public:
+	std::type_index type;
+	std::string key;
+	std::chrono::steady_clock::time_point until;
+	std::size_t uses = 0;
+	// In a context now, and so not to be reused or released
+	bool active = true;
+
+	_Lingering(std::type_index t, std::string k) : type(t), key(std::move(k)){};
+	virtual ~_Lingering() = default;
+
+	// Exits the resource manager with e, returning whether it suppressed it
+	virtual bool exit(std::exception_ptr e) = 0;
+
+	void release() noexcept {
+		try {
+			exit(nullptr);
+		} catch (...) {}
+	}
+};
+
+template <class manager>
+class _LingeringManager : public _Lingering {
+public:
+	std::unique_ptr<manager> resource;
+
+	_LingeringManager(std::type_index t, std::string k, std::unique_ptr<manager> m)
+		: _Lingering(t, std::move(k)), resource(std::move(m)){};
+
+	bool exit(std::exception_ptr e) override {
+		return ContextAccess::exit(ContextAccess::handle(*resource), e);
+	}
+};
+
+// The thread's lingering resources, from the least recently used
+class _LingerCache {
+private:
+	std::vector<std::unique_ptr<_Lingering>> _entries;
+
+public:
+	_LingerCache() = default;
+	_LingerCache(const _LingerCache& other) = delete;
+
+	~_LingerCache(){
+		flush();
+	}
+
+	static _LingerCache& local(){
+		static thread_local _LingerCache cache;
+		return cache;
+	}
+
+	// Releases what is past its time
+	void expire(std::chrono::steady_clock::time_point now){
+		for (std::size_t i = 0; i < _entries.size();) {
+			if (!_entries[i]->active && _entries[i]->until <= now) {
+				release(i);
+			} else {
+				++i;
+			}
+		}
+	}
+
+	// Finds a resource lingering under the key, and marks it active
+	_Lingering* take(std::type_index type, const std::string& key){
+		for (std::size_t i = _entries.size(); i-- > 0;) {
+			_Lingering& entry = *_entries[i];
+			if (!entry.active && entry.type == type && entry.key == key) {
+				entry.active = true;
+				// Now the most recently used
+				std::unique_ptr<_Lingering> taken = std::move(_entries[i]);
+				_entries.erase(_entries.begin() + i);
+				_entries.push_back(std::move(taken));
+				return &entry;
+			}
+		}
+		return nullptr;
+	}
+
+	// Makes sure add cannot fail, before the resource it adds is entered
+	void reserve(){
+		_entries.reserve(_entries.size() + 1);
+	}
+
+	// Adds a resource just entered, making room for it under the capacity
+	// of its type, which a capacity of 0 does not, as the resource will not
+	// linger; once reserve was called, without throwing
+	_Lingering* add(std::unique_ptr<_Lingering> entry, std::size_t capacity) noexcept {
+		std::size_t same = 0;
+		for (auto& e : _entries) {
+			same += e->type == entry->type;
+		}
+		for (std::size_t i = 0; i < _entries.size() && capacity && same >= capacity;) {
+			if (!_entries[i]->active && _entries[i]->type == entry->type) {
+				release(i);
+				--same;
+			} else {
+				++i;
+			}
+		}
+		_entries.push_back(std::move(entry));
+		return _entries.back().get();
+	}
+
+	// Takes an entry out of the cache without exiting it
+	std::unique_ptr<_Lingering> remove(_Lingering* entry){
+		for (std::size_t i = 0; i < _entries.size(); ++i) {
+			if (_entries[i].get() == entry) {
+				std::unique_ptr<_Lingering> removed = std::move(_entries[i]);
+				_entries.erase(_entries.begin() + i);
+				return removed;
+			}
+		}
+		return nullptr;
+	}
+
+	void release(std::size_t i){
+		std::unique_ptr<_Lingering> entry = std::move(_entries[i]);
+		_entries.erase(_entries.begin() + i);
+		entry->release();
+	}
+
+	// Releases every resource not in a context
+	void flush(){
+		for (std::size_t i = 0; i < _entries.size();) {
+			if (!_entries[i]->active) {
+				release(i);
+			} else {
+				++i;
+			}
+		}
+	}
+
+	std::size_t lingering() const {
+		std::size_t count = 0;
+		for (auto& entry : _entries) {
+			count += !entry->active;
+		}
+		return count;
+	}
+};
+
+// Releases the calling thread's lingering resources now
+inline void flush_lingering(){
+	_LingerCache::local().flush();
+}
+
+// How many resources the calling thread keeps acquired outside contexts
+inline std::size_t lingering_count(){
+	return _LingerCache::local().lingering();
+}
+
+/************************************
+*									*
+* 	The resource manager			*
+*									*
+************************************/
+
+template <class manager>
+using _linger_data_t = std::remove_pointer_t<
+	decltype(ContextAccess::get(ContextAccess::handle(std::declval<manager&>())))>;
+
+template <class manager, class make>
+class Linger : public StaticResource<Linger<manager, make>, _linger_data_t<manager>> {
+private:
+	friend struct ContextAccess;
+
+	std::string _key;
+	make _make;
+	LingerPolicy _policy;
+	_Lingering* _entry = nullptr;
+
+	void enter(){
+		_LingerCache& cache = _LingerCache::local();
+		auto now = std::chrono::steady_clock::now();
+		cache.expire(now);
+		_entry = cache.take(typeid(manager), _key);
+		if (!_entry) {
+			auto made = std::make_unique<_LingeringManager<manager>>(
+				typeid(manager), _key, std::unique_ptr<manager>(new manager(_make())));
+			// Or an entered resource could be lost to a failure to add it
+			cache.reserve();
+			ContextAccess::enter(ContextAccess::handle(*made->resource));
+			_entry = cache.add(std::move(made), _policy.capacity);
+		}
+		this->resources = ContextAccess::get(ContextAccess::handle(
+			*static_cast<_LingeringManager<manager>*>(_entry)->resource));
+	}
+
+	bool exit(std::exception_ptr e){
+		_LingerCache& cache = _LingerCache::local();
+		_Lingering* entry = _entry;
+		_entry = nullptr;
+		if (e) {
+			return cache.remove(entry)->exit(e);
+		}
+		entry->active = false;
+		++entry->uses;
+		entry->until = std::chrono::steady_clock::now() + _policy.time;
+		if ((_policy.uses && entry->uses >= _policy.uses) || _policy.time.count() <= 0 || !_policy.capacity) {
+			std::unique_ptr<_Lingering> removed = cache.remove(entry);
+			return removed->exit(nullptr);
+		}
+		return false;
+	}
+
+public:
+	Linger(std::string key, make m, LingerPolicy policy)
+		: _key(std::move(key)), _make(std::move(m)), _policy(policy){};
+};
+
+// Lingers the resource manager make() returns under key
+template <class make>
+auto linger(std::string key, make&& m, LingerPolicy policy = LingerPolicy()){
+	using manager = decltype(m());
+	return Linger<manager, std::decay_t<make>>(std::move(key), std::forward<make>(m), policy);
+}
+
+};
+
+#endif
@@ -0,0 +1,612 @@
+#ifndef CONTEXTUAL_LOCK_H
+#define CONTEXTUAL_LOCK_H
+
+#include <contextual.h>
+#include <contextual/registry.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <shared_mutex>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <vector>
+
+/*
+
+Resource managers that hold locks for the duration of a code block.
+
+A Guarded object keeps a value together with the mutex protecting it, and
+only hands the value out to a code block while the mutex is held:
+
+	Guarded<Accounts> accounts;
+
+	with {
+		locked(accounts)(
+			[&](Accounts* a){ ... }
+		)
+	};
+
+locked takes the mutex exclusively, locked_shared in shared mode, for a
+std::shared_mutex, where the block receives a const pointer, and locked_for
+waits at most the given time for a timed mutex, throwing a std::system_error
+with std::errc::timed_out otherwise. Each also takes a bare mutex, or any
+other type with lock, try_lock and unlock, whose block then receives the
+mutex itself.
+
+Taking several locks by nesting with blocks invites lock order inversions
+between threads. lock_all takes them together, deadlock free, with
+std::lock's back-off, and releases them in reverse:
+
+	with {
+		lock_all(locked(from), locked(to))(
+			[&](Account* f, Account* t){ ... }
+		)
+	};
+
+Each of them also takes a name, locked(accounts, "accounts"), for lock
+contention statistics. Under the instrumentation policy of
+contextual/instrument.h, every named lock taken in an observed context
+records how often it was taken, how often it was contended, how long
+threads waited for it and held it, and how many were waiting at most:
+
+	for (auto& lock : hottest_locks(10)) { ... }
+	dump_hottest_locks(std::cerr);
+
+So with the sampled policy, only the locks of the contexts sampled are
+counted. Each thread counts into its own slots, which are only summed when
+the statistics are read. Under the off policy the names are ignored and a
+named lock is the same as an unnamed one.
+
+*/
+
+namespace Contextual {
+
+/************************************
+*									*
+* 	Ways of taking a mutex			*
+*									*
+************************************/
+
+// Each is a Lockable over a mutex, so that std::lock can take any mix of them
+
+template <class mutex>
+class _Exclusive {
+private:
+	mutex& _mutex;
+
+public:
+	explicit _Exclusive(mutex& m) : _mutex(m){};
+
+	void lock(){ _mutex.lock(); }
+	bool try_lock(){ return _mutex.try_lock(); }
+	void unlock(){ _mutex.unlock(); }
+};
+
+template <class mutex>
+class _Shared {
+private:
+	mutex& _mutex;
+
+public:
+	explicit _Shared(mutex& m) : _mutex(m){};
+
+	void lock(){ _mutex.lock_shared(); }
+	bool try_lock(){ return _mutex.try_lock_shared(); }
+	void unlock(){ _mutex.unlock_shared(); }
+};
+
+template <class mutex, class duration>
+class _Timed {
+private:
+	mutex& _mutex;
+	duration _timeout;
+
+public:
+	_Timed(mutex& m, duration timeout) : _mutex(m), _timeout(timeout){};
+
+	void lock(){
+		if (!_mutex.try_lock_for(_timeout)) {
+			throw std::system_error(std::make_error_code(std::errc::timed_out), "lock timed out");
+		}
+	}
+	bool try_lock(){ return _mutex.try_lock(); }
+	void unlock(){ _mutex.unlock(); }
+};
+
+/************************************
+*									*
+* 	Lock contention statistics		*
+*									*
+************************************/
+
+// The statistics of one named lock, summed over all threads
+struct LockReport {
+	std::string name;
+	std::uint64_t acquisitions = 0;
+	std::uint64_t contentions = 0;
+	std::chrono::nanoseconds wait{0};
+	std::chrono::nanoseconds hold{0};
+	std::size_t max_queue_depth = 0;
+
+	void subtract(const LockReport& other){
+		acquisitions -= other.acquisitions;
+		contentions -= other.contentions;
+		wait -= other.wait;
+		hold -= other.hold;
+	}
+};
+
+// What every thread shares about a named lock
+struct _LockQueue {
+	// Threads currently waiting, only touched when the lock is contended
+	std::atomic<std::size_t> waiting{0};
+	std::atomic<std::size_t> max_queue_depth{0};
+
+	void reset(){
+		max_queue_depth.store(0, std::memory_order_relaxed);
+	}
+};
+
+// One thread's counts for one named lock
+struct _LockCounts {
+	std::atomic<std::uint64_t> acquisitions{0};
+	std::atomic<std::uint64_t> contentions{0};
+	std::atomic<std::uint64_t> wait{0};
+	std::atomic<std::uint64_t> hold{0};
+
+	void add_to(LockReport& total) const {
+		total.acquisitions += acquisitions.load(std::memory_order_relaxed);
+		total.contentions += contentions.load(std::memory_order_relaxed);
+		total.wait += std::chrono::nanoseconds(wait.load(std::memory_order_relaxed));
+		total.hold += std::chrono::nanoseconds(hold.load(std::memory_order_relaxed));
+	}
+};
+
+// An observer only so that contexts are observed while there are named
+// locks; the locks count for themselves, and only in observed contexts
+class _LockStatistics : public _NamedStatistics<_LockStatistics, _LockCounts, LockReport, _LockQueue>,
+						public ContextObserver {
+private:
+	_LockStatistics(){
+		add_observer(*this);
+	}
+
+public:
+	~_LockStatistics(){
+		remove_observer(*this);
+	}
+
+	static _LockStatistics& global(){
+		static _LockStatistics statistics;
+		return statistics;
+	}
+
+	void end(const ContextSample& sample) override {}
+
+	std::vector<LockReport> statistics(){
+		std::vector<LockReport> reports;
+		for (auto& [site, total] : since_reset()) {
+			total.name = site->name;
+			total.max_queue_depth = site->state.max_queue_depth.load(std::memory_order_relaxed);
+			reports.push_back(std::move(total));
+		}
+		return reports;
+	}
+};
+
+using _LockSlot = _LockStatistics::_Slot;
+
+// Every named lock taken since the last reset
+inline std::vector<LockReport> lock_statistics(){
+	return _LockStatistics::global().statistics();
+}
+
+// The n named locks threads have waited for longest
+inline std::vector<LockReport> hottest_locks(std::size_t n){
+	std::vector<LockReport> reports = lock_statistics();
+	std::sort(reports.begin(), reports.end(), [](const LockReport& a, const LockReport& b){
+		return a.wait > b.wait;
+	});
+	if (reports.size() > n) {
+		reports.resize(n);
+	}
+	return reports;
+}
+
+inline void dump_hottest_locks(std::ostream& out, std::size_t n=10){
+	out << "lock\tacquisitions\tcontentions\twait_ns\thold_ns\tmax_queue_depth\n";
+	for (const LockReport& r : hottest_locks(n)) {
+		out << r.name << '\t' << r.acquisitions << '\t' << r.contentions << '\t' << r.wait.count() << '\t'
+			<< r.hold.count() << '\t' << r.max_queue_depth << '\n';
+	}
+}
+
+inline void reset_lock_statistics(){
+	_LockStatistics::global().reset();
+}
+
+// Wraps a way of taking a mutex to count into this thread's slot for the
+// lock's name. An uncontended lock costs two clock reads; only a contended
+// one touches the shared queue depth.
+template <class lockable>
+class _Instrumented {
+private:
+	template <class... locks>
+	friend class LockAll;
+	using _clock = std::chrono::steady_clock;
+
+	lockable _lockable;
+	_LockSlot* _slot;
+	_clock::time_point _acquired;
+	// Whether the lock is counted, decided when it is taken
+	bool _counting = false;
+
+	static std::uint64_t _since(_clock::time_point start){
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(_clock::now() - start).count();
+	}
+
+	void _queue(){
+		_LockQueue& queue = _slot->site->state;
+		std::size_t depth = queue.waiting.fetch_add(1, std::memory_order_relaxed) + 1;
+		std::size_t deepest = queue.max_queue_depth.load(std::memory_order_relaxed);
+		while (depth > deepest && !queue.max_queue_depth.compare_exchange_weak(deepest, depth,
+																			 std::memory_order_relaxed)) {}
+	}
+
+	void _dequeue(){
+		_slot->site->state.waiting.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	void _taken(){
+		_add_counter(_slot->values.acquisitions, 1);
+		_acquired = _clock::now();
+	}
+
+	void _contended(std::uint64_t wait){
+		_add_counter(_slot->values.wait, wait);
+		_add_counter(_slot->values.contentions, 1);
+	}
+
+public:
+	_Instrumented(lockable l, const char* name) : _lockable(std::move(l)), _slot(&_LockStatistics::_Table::local().slot(name)){};
+
+	void lock(){
+		_counting = context_observed();
+		if (!_counting) {
+			_lockable.lock();
+			return;
+		}
+		if (_lockable.try_lock()) {
+			_taken();
+			return;
+		}
+		_queue();
+		_clock::time_point start = _clock::now();
+		try{
+			_lockable.lock();
+		} catch (...) {
+			_dequeue();
+			throw;
+		}
+		_dequeue();
+		_contended(_since(start));
+		_taken();
+	}
+
+	bool try_lock(){
+		_counting = context_observed();
+		if (!_counting) {
+			return _lockable.try_lock();
+		}
+		if (_lockable.try_lock()) {
+			_taken();
+			return true;
+		}
+		_add_counter(_slot->values.contentions, 1);
+		return false;
+	}
+
+	void unlock(){
+		if (_counting) {
+			_add_counter(_slot->values.hold, _since(_acquired));
+		}
+		_lockable.unlock();
+	}
+};
+
+/************************************
+*									*
+* 	Objects guarded by a mutex		*
+*									*
+************************************/
+
+template <class value, class mutex = std::mutex>
+class Guarded {
+private:
+	friend struct _GuardedAccess;
+
+	mutex _mutex;
+	value _value;
+
+public:
+	template <class... args>
+	explicit Guarded(args&&... arguments) : _value(std::forward<args>(arguments)...){};
+	Guarded(const Guarded& other) = delete;
+	Guarded& operator=(const Guarded& other) = delete;
+};
+
+struct _GuardedAccess {
+	template <class value, class mutex>
+	static value& get(Guarded<value, mutex>& g){ return g._value; }
+
+	template <class value, class mutex>
+	static mutex& lockable(Guarded<value, mutex>& g){ return g._mutex; }
+};
+
+/************************************
+*									*
+* 	The lock resource manager		*
+*									*
+************************************/
+
+template <class... locks>
+class LockAll;
+
+// Holds a lock for the duration of the context, giving the code block the
+// data it guards
+template <class data, class lockable>
+class LockResource : public StaticResource<LockResource<data, lockable>, data> {
+private:
+	friend struct ContextAccess;
+	template <class... locks>
+	friend class LockAll;
+	using _base = StaticResource<LockResource<data, lockable>, data>;
+
+	lockable _lockable;
+
+	void enter(){
+		_lockable.lock();
+	}
+
+	bool exit(std::exception_ptr e) noexcept {
+		_lockable.unlock();
+		return false;
+	}
+
+public:
+	LockResource(data& resources, lockable l) : _base(resources), _lockable(std::move(l)){};
+};
+
+template <class mutex>
+LockResource<mutex, _Exclusive<mutex>> locked(mutex& m){
+	return LockResource<mutex, _Exclusive<mutex>>(m, _Exclusive<mutex>(m));
+}
+
+template <class value, class mutex>
+LockResource<value, _Exclusive<mutex>> locked(Guarded<value, mutex>& g){
+	mutex& m = _GuardedAccess::lockable(g);
+	return LockResource<value, _Exclusive<mutex>>(_GuardedAccess::get(g), _Exclusive<mutex>(m));
+}
+
+template <class mutex>
+LockResource<mutex, _Shared<mutex>> locked_shared(mutex& m){
+	return LockResource<mutex, _Shared<mutex>>(m, _Shared<mutex>(m));
+}
+
+template <class value, class mutex>
+LockResource<const value, _Shared<mutex>> locked_shared(Guarded<value, mutex>& g){
+	mutex& m = _GuardedAccess::lockable(g);
+	return LockResource<const value, _Shared<mutex>>(_GuardedAccess::get(g), _Shared<mutex>(m));
+}
+
+template <class mutex, class rep, class period>
+LockResource<mutex, _Timed<mutex, std::chrono::duration<rep, period>>>
+locked_for(mutex& m, std::chrono::duration<rep, period> timeout){
+	using timed = _Timed<mutex, std::chrono::duration<rep, period>>;
+	return LockResource<mutex, timed>(m, timed(m, timeout));
+}
+
+template <class value, class mutex, class rep, class period>
+LockResource<value, _Timed<mutex, std::chrono::duration<rep, period>>>
+locked_for(Guarded<value, mutex>& g, std::chrono::duration<rep, period> timeout){
+	using timed = _Timed<mutex, std::chrono::duration<rep, period>>;
+	mutex& m = _GuardedAccess::lockable(g);
+	return LockResource<value, timed>(_GuardedAccess::get(g), timed(m, timeout));
+}
+
+// The named versions of the above, which are the same as them under the off
+// instrumentation policy
+template <class data, class lockable>
+auto _named_lock(data& resources, lockable l, const char* name){
+	if constexpr (instrumentation_of<LockResource<data, _Instrumented<lockable>>>::value != Instrumentation::off) {
+		return LockResource<data, _Instrumented<lockable>>(resources, _Instrumented<lockable>(std::move(l), name));
+	} else {
+		return LockResource<data, lockable>(resources, std::move(l));
+	}
+}
+
+template <class mutex>
+auto locked(mutex& m, const char* name){
+	return _named_lock(m, _Exclusive<mutex>(m), name);
+}
+
+template <class value, class mutex>
+auto locked(Guarded<value, mutex>& g, const char* name){
+	return _named_lock(_GuardedAccess::get(g), _Exclusive<mutex>(_GuardedAccess::lockable(g)), name);
+}
+
+template <class mutex>
+auto locked_shared(mutex& m, const char* name){
+	return _named_lock(m, _Shared<mutex>(m), name);
+}
+
+template <class value, class mutex>
+auto locked_shared(Guarded<value, mutex>& g, const char* name){
+	const value& resources = _GuardedAccess::get(g);
+	return _named_lock(resources, _Shared<mutex>(_GuardedAccess::lockable(g)), name);
+}
+
+template <class mutex, class rep, class period>
+auto locked_for(mutex& m, std::chrono::duration<rep, period> timeout, const char* name){
+	return _named_lock(m, _Timed<mutex, std::chrono::duration<rep, period>>(m, timeout), name);
+}
+
+template <class value, class mutex, class rep, class period>
+auto locked_for(Guarded<value, mutex>& g, std::chrono::duration<rep, period> timeout, const char* name){
+	using timed = _Timed<mutex, std::chrono::duration<rep, period>>;
+	return _named_lock(_GuardedAccess::get(g), timed(_GuardedAccess::lockable(g), timeout), name);
+}
+
+/************************************
+*									*
+* 	Several locks at once			*
+*									*
+************************************/
+
+// The resource manager built by lock_all. Like All it holds references to
+// the temporary Locks it was given, but rather than entering them in turn
+// it takes all of them with std::lock, which backs off and retries instead
+// of waiting while holding some of them. If taking one throws, as a timed
+// lock does on timeout, none are left held. They are released in reverse.
+// Giving it the same mutex twice is undefined, as for std::lock.
+template <class... locks>
+class LockAll : public StaticResource<LockAll<locks...>,
+									  std::tuple<typename locks::data_type*...>,
+									  Owned> {
+private:
+	friend struct ContextAccess;
+	using _base = StaticResource<LockAll<locks...>, std::tuple<typename locks::data_type*...>, Owned>;
+	using _indices = std::index_sequence_for<locks...>;
+
+	std::tuple<locks&...> _locks;
+
+	// std::lock backs off by taking and releasing the locks over and over,
+	// so it is given the bare lockables of named locks, and each named lock
+	// is counted once: contended if it was the one busy at the first try,
+	// having waited for all of std::lock
+	template <class lockable>
+	static lockable& _raw(lockable& l){ return l; }
+	template <class lockable>
+	static lockable& _raw(_Instrumented<lockable>& l){ return l._lockable; }
+
+	template <class lockable>
+	static void _count(lockable& l, bool counting){}
+	template <class lockable>
+	static void _count(_Instrumented<lockable>& l, bool counting){
+		l._counting = counting;
+	}
+
+	template <class lockable>
+	static void _waiting(lockable& l, bool waiting){}
+	template <class lockable>
+	static void _waiting(_Instrumented<lockable>& l, bool waiting){
+		if (waiting) {
+			l._queue();
+		}
+	}
+
+	template <class lockable>
+	static void _waited(lockable& l, bool waited){}
+	template <class lockable>
+	static void _waited(_Instrumented<lockable>& l, bool waited){
+		if (waited) {
+			l._dequeue();
+		}
+	}
+
+	template <class lockable>
+	static void _taken(lockable& l, bool contended, std::uint64_t wait){}
+	template <class lockable>
+	static void _taken(_Instrumented<lockable>& l, bool contended, std::uint64_t wait){
+		if (contended) {
+			l._contended(wait);
+		}
+		l._taken();
+	}
+
+	template <std::size_t... i>
+	void _lock(std::index_sequence<i...>){
+		using clock = std::chrono::steady_clock;
+		if constexpr (sizeof...(locks) == 1) {
+			std::get<0>(_locks)._lockable.lock();
+		} else {
+			bool counting = context_observed();
+			(_count(std::get<i>(_locks)._lockable, counting), ...);
+			if (!counting) {
+				std::lock(_raw(std::get<i>(_locks)._lockable)...);
+				return;
+			}
+			int busy = std::try_lock(_raw(std::get<i>(_locks)._lockable)...);
+			if (busy == -1) {
+				(_taken(std::get<i>(_locks)._lockable, false, 0), ...);
+				return;
+			}
+			(_waiting(std::get<i>(_locks)._lockable, static_cast<int>(i) == busy), ...);
+			clock::time_point start = clock::now();
+			try {
+				std::lock(_raw(std::get<i>(_locks)._lockable)...);
+			} catch (...) {
+				(_waited(std::get<i>(_locks)._lockable, static_cast<int>(i) == busy), ...);
+				throw;
+			}
+			std::uint64_t wait = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+			(_waited(std::get<i>(_locks)._lockable, static_cast<int>(i) == busy), ...);
+			(_taken(std::get<i>(_locks)._lockable, static_cast<int>(i) == busy, wait), ...);
+		}
+	}
+
+	template <std::size_t... i>
+	void _unlock(std::index_sequence<i...>) noexcept {
+		constexpr std::size_t last = sizeof...(locks) - 1;
+		(std::get<last - i>(_locks)._lockable.unlock(), ...);
+	}
+
+	template <class block, std::size_t... i>
+	static constexpr bool _nothrow_block(std::index_sequence<i...>){
+		using data = typename _base::data_type;
+		return std::is_nothrow_invocable<block, std::tuple_element_t<i, data>&...>::value;
+	}
+
+	void enter(){
+		_lock(_indices());
+	}
+
+	bool exit(std::exception_ptr e) noexcept {
+		_unlock(_indices());
+		return false;
+	}
+
+public:
+	explicit LockAll(locks&... l) : _base(std::in_place, ContextAccess::get(l)...), _locks(l...){};
+
+	// The code block takes the data of each lock as a separate argument, in
+	// order
+	template <class block>
+	With operator()(block&& code_block){
+		using data = typename _base::data_type;
+		constexpr bool nothrow = _nothrow_block<block>(_indices());
+		return _base::operator()([&](data* resources) noexcept(nothrow){
+			std::apply(std::forward<block>(code_block), *resources);
+		});
+	}
+	With operator()(){
+		return _base::operator()();
+	}
+};
+
+// Takes several locks in one context without risk of deadlock:
+//
+//		with { lock_all(locked(a), locked_shared(b))([&](auto a, auto b){ ... }) };
+template <class... locks>
+auto lock_all(locks&&... l){
+	static_assert(sizeof...(locks) > 0, "lock_all needs at least one lock");
+	return LockAll<std::remove_reference_t<locks>...>(l...);
+}
+
+};
+
+#endif
@@ -0,0 +1,438 @@
+#ifndef CONTEXTUAL_PERF_H
+#define CONTEXTUAL_PERF_H
+
+#include <contextual.h>
+#include <contextual/registry.h>
+
+#if !defined(__linux__)
+#error "contextual/perf.h requires Linux"
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+
+Hardware and software counters of a code block, per context name.
+
+PerfCounters is a resource manager that reads the counters of the thread
+running it when entered and again when exited, and adds the difference to
+the totals of its name:
+
+	with {
+		PerfCounters("parse")([&](CounterValues* counters){
+			...
+		})
+	};
+
+	dump_counter_statistics(std::cerr);
+
+The block receives where the differences are put on exit; given a
+CounterValues of its own, PerfCounters(values, "parse") puts them there so
+they can be looked at afterwards.
+
+Each thread opens its perf_event_open groups the first time it is counted
+and keeps them until it exits, so entering and exiting cost a few system
+calls rather than opening anything. Not every counter can be read
+everywhere: containers and virtual machines often have no hardware
+counters, and perf_event_paranoid may forbid them all. Counters fall back,
+one by one, from hardware events to software events to getrusage, and
+those that could not be read at all are left out of CounterValues'
+measured set. CPU time always comes from the thread's CPU clock.
+
+A thread keeps counts for 1024 names at most; those of any name beyond
+them are counted under "(other names)".
+
+*/
+
+namespace Contextual {
+
+/************************************
+*									*
+* 	Counter values					*
+*									*
+************************************/
+
+enum class CounterKind : unsigned {
+	instructions,
+	cycles,
+	cache_misses,
+	branch_misses,
+	page_faults,
+	context_switches
+};
+
+inline constexpr std::size_t counter_count = 6;
+
+inline const char* counter_name(CounterKind counter){
+	static const char* const names[counter_count] = {
+		"instructions", "cycles", "cache_misses", "branch_misses", "page_faults", "context_switches"
+	};
+	return names[static_cast<unsigned>(counter)];
+}
+
+// Where a thread reads a counter from
+enum class CounterSource {
+	none,
+	hardware,
+	software,
+	rusage
+};
+
+// The counts of a span of time, of the counters that could be read
+struct CounterValues {
+	std::uint64_t values[counter_count] = {};
+	// A bit for each counter that was read
+	unsigned measured = 0;
+	std::chrono::nanoseconds cpu_time{0};
+
+	bool has(CounterKind counter) const {
+		return measured & (1u << static_cast<unsigned>(counter));
+	}
+
+	std::uint64_t operator[](CounterKind counter) const {
+		return values[static_cast<unsigned>(counter)];
+	}
+};
+
+// The counters of a thread at one moment, unscaled
+struct _CounterReading {
+	std::uint64_t values[counter_count] = {};
+	// How long the group of each counter had been enabled, and running on
+	// the hardware, in nanoseconds; both 0 for counters outside groups
+	std::uint64_t enabled[counter_count] = {};
+	std::uint64_t running[counter_count] = {};
+	std::int64_t cpu_time = 0;
+
+	// What a counter counted since start. A group that had to share the
+	// hardware with others only counted while it was running, so the count
+	// is scaled up by the part of the span it ran for.
+	std::uint64_t since(const _CounterReading& start, std::size_t i) const {
+		std::uint64_t value = values[i] - start.values[i];
+		std::uint64_t enabled_for = enabled[i] - start.enabled[i];
+		std::uint64_t running_for = running[i] - start.running[i];
+		if (running_for && running_for < enabled_for) {
+			value = static_cast<std::uint64_t>(static_cast<double>(value) * enabled_for / running_for);
+		}
+		return value;
+	}
+};
+
+/************************************
+*									*
+* 	Per-thread counter groups		*
+*									*
+************************************/
+
+class _PerfEvents {
+private:
+	// Counters read together, by one read of the group leader, in the order
+	// they were added
+	struct _Group {
+		int leader = -1;
+		std::size_t size = 0;
+		int fds[counter_count];
+		CounterKind order[counter_count];
+	};
+
+	_Group _hardware;
+	_Group _software;
+	CounterSource _sources[counter_count] = {};
+
+	static int _open(std::uint32_t type, std::uint64_t config, bool exclude_kernel, int group){
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.exclude_kernel = exclude_kernel;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC));
+	}
+
+	// Adds a counter of this thread to a group, counting the kernel's share
+	// of it too where that is allowed
+	bool _add(_Group& group, CounterKind counter, std::uint32_t type, std::uint64_t config){
+		int fd = _open(type, config, false, group.leader);
+		if (fd < 0) {
+			fd = _open(type, config, true, group.leader);
+		}
+		if (fd < 0) {
+			return false;
+		}
+		if (group.leader < 0) {
+			group.leader = fd;
+		}
+		group.fds[group.size] = fd;
+		group.order[group.size++] = counter;
+		return true;
+	}
+
+	void _read(const _Group& group, _CounterReading& into) const {
+		if (group.leader < 0) {
+			return;
+		}
+		// The number of counters, the times the group was enabled and
+		// running, then each counter
+		std::uint64_t buffer[3 + counter_count];
+		if (::read(group.leader, buffer, sizeof(buffer)) < static_cast<ssize_t>(3 * sizeof(std::uint64_t))) {
+			return;
+		}
+		for (std::size_t i = 0; i < group.size && i < buffer[0]; ++i) {
+			unsigned counter = static_cast<unsigned>(group.order[i]);
+			into.values[counter] = buffer[3 + i];
+			into.enabled[counter] = buffer[1];
+			into.running[counter] = buffer[2];
+		}
+	}
+
+public:
+	_PerfEvents(){
+		const std::pair<CounterKind, std::uint64_t> hardware[] = {
+			{CounterKind::instructions, PERF_COUNT_HW_INSTRUCTIONS},
+			{CounterKind::cycles, PERF_COUNT_HW_CPU_CYCLES},
+			{CounterKind::cache_misses, PERF_COUNT_HW_CACHE_MISSES},
+			{CounterKind::branch_misses, PERF_COUNT_HW_BRANCH_MISSES}
+		};
+		for (auto& [counter, config] : hardware) {
+			if (_add(_hardware, counter, PERF_TYPE_HARDWARE, config)) {
+				_sources[static_cast<unsigned>(counter)] = CounterSource::hardware;
+			}
+		}
+		const std::pair<CounterKind, std::uint64_t> software[] = {
+			{CounterKind::page_faults, PERF_COUNT_SW_PAGE_FAULTS},
+			{CounterKind::context_switches, PERF_COUNT_SW_CONTEXT_SWITCHES}
+		};
+		for (auto& [counter, config] : software) {
+			if (_add(_software, counter, PERF_TYPE_SOFTWARE, config)) {
+				_sources[static_cast<unsigned>(counter)] = CounterSource::software;
+			} else {
+				_sources[static_cast<unsigned>(counter)] = CounterSource::rusage;
+			}
+		}
+	}
+	_PerfEvents(const _PerfEvents& other) = delete;
+
+	// Closing a group leader leaves the others open, so each is closed
+	~_PerfEvents(){
+		for (_Group* group : {&_hardware, &_software}) {
+			for (std::size_t i = 0; i < group->size; ++i) {
+				::close(group->fds[i]);
+			}
+		}
+	}
+
+	static _PerfEvents& local(){
+		static thread_local _PerfEvents events;
+		return events;
+	}
+
+	CounterSource source(CounterKind counter) const {
+		return _sources[static_cast<unsigned>(counter)];
+	}
+
+	unsigned measured() const {
+		unsigned mask = 0;
+		for (std::size_t i = 0; i < counter_count; ++i) {
+			if (_sources[i] != CounterSource::none) {
+				mask |= 1u << i;
+			}
+		}
+		return mask;
+	}
+
+	void read(_CounterReading& into) const {
+		_read(_hardware, into);
+		_read(_software, into);
+		if (source(CounterKind::page_faults) == CounterSource::rusage
+			|| source(CounterKind::context_switches) == CounterSource::rusage) {
+			rusage usage;
+			if (getrusage(RUSAGE_THREAD, &usage) == 0) {
+				if (source(CounterKind::page_faults) == CounterSource::rusage) {
+					into.values[static_cast<unsigned>(CounterKind::page_faults)] = usage.ru_minflt + usage.ru_majflt;
+				}
+				if (source(CounterKind::context_switches) == CounterSource::rusage) {
+					into.values[static_cast<unsigned>(CounterKind::context_switches)] = usage.ru_nvcsw + usage.ru_nivcsw;
+				}
+			}
+		}
+		timespec now;
+		if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) == 0) {
+			into.cpu_time = static_cast<std::int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+		}
+	}
+};
+
+// Where the calling thread reads a counter from
+inline CounterSource counter_source(CounterKind counter){
+	return _PerfEvents::local().source(counter);
+}
+
+/************************************
+*									*
+* 	Totals per context name			*
+*									*
+************************************/
+
+// The counters of every context of one name, summed over all threads
+struct CounterReport {
+	std::string name;
+	std::uint64_t count = 0;
+	CounterValues total;
+
+	// Which counters were measured is kept, as it only ever grows
+	void subtract(const CounterReport& other){
+		count -= other.count;
+		for (std::size_t i = 0; i < counter_count; ++i) {
+			total.values[i] -= other.total.values[i];
+		}
+		total.cpu_time -= other.total.cpu_time;
+	}
+};
+
+// One thread's counts for one name, written only by that thread
+struct _CounterCounts {
+	std::atomic<std::uint64_t> count{0};
+	std::atomic<std::uint64_t> values[counter_count] = {};
+	std::atomic<std::uint64_t> cpu_time{0};
+	std::atomic<unsigned> measured{0};
+
+	void add(const CounterValues& values){
+		_add_counter(count, 1);
+		for (std::size_t i = 0; i < counter_count; ++i) {
+			_add_counter(this->values[i], values.values[i]);
+		}
+		_add_counter(cpu_time, static_cast<std::uint64_t>(values.cpu_time.count()));
+		measured.store(measured.load(std::memory_order_relaxed) | values.measured, std::memory_order_relaxed);
+	}
+
+	void add_to(CounterReport& total) const {
+		total.count += count.load(std::memory_order_relaxed);
+		for (std::size_t i = 0; i < counter_count; ++i) {
+			total.total.values[i] += values[i].load(std::memory_order_relaxed);
+		}
+		total.total.cpu_time += std::chrono::nanoseconds(cpu_time.load(std::memory_order_relaxed));
+		total.total.measured |= measured.load(std::memory_order_relaxed);
+	}
+};
+
+class _CounterStatistics : public _NamedStatistics<_CounterStatistics, _CounterCounts, CounterReport> {
+private:
+	_CounterStatistics() = default;
+
+public:
+	static _CounterStatistics& global(){
+		static _CounterStatistics statistics;
+		return statistics;
+	}
+
+	std::vector<CounterReport> statistics(){
+		std::vector<CounterReport> reports;
+		for (auto& [site, total] : since_reset()) {
+			total.name = site->name;
+			if (total.count) {
+				reports.push_back(std::move(total));
+			}
+		}
+		return reports;
+	}
+};
+
+using _CounterSlot = _CounterStatistics::_Slot;
+
+// Every context name counted since the last reset
+inline std::vector<CounterReport> counter_statistics(){
+	return _CounterStatistics::global().statistics();
+}
+
+// A table of the totals per context name; counters that were never read
+// are written as -
+inline void dump_counter_statistics(std::ostream& out){
+	out << "context\tcount\tcpu_ns";
+	for (std::size_t i = 0; i < counter_count; ++i) {
+		out << '\t' << counter_name(static_cast<CounterKind>(i));
+	}
+	out << '\n';
+	for (const CounterReport& r : counter_statistics()) {
+		out << r.name << '\t' << r.count << '\t' << r.total.cpu_time.count();
+		for (std::size_t i = 0; i < counter_count; ++i) {
+			CounterKind counter = static_cast<CounterKind>(i);
+			out << '\t';
+			if (r.total.has(counter)) {
+				out << r.total[counter];
+			} else {
+				out << '-';
+			}
+		}
+		out << '\n';
+	}
+}
+
+inline void reset_counter_statistics(){
+	_CounterStatistics::global().reset();
+}
+
+/************************************
+*									*
+* 	The resource manager			*
+*									*
+************************************/
+
+// Counts its code block under a name, which is its context name as well, so
+// observers see it under the same one.
+class PerfCounters : public StaticResource<PerfCounters, CounterValues> {
+private:
+	friend struct ContextAccess;
+
+	const char* _name;
+	CounterValues _values;
+	_CounterReading _start;
+	// Looked up on enter, which may allocate it, so that exit cannot fail
+	_CounterSlot* _slot = nullptr;
+
+	void enter(){
+		_slot = &_CounterStatistics::_Table::local().slot(_name);
+		_PerfEvents::local().read(_start);
+	}
+
+	bool exit(std::exception_ptr e) noexcept {
+		_PerfEvents& events = _PerfEvents::local();
+		_CounterReading end = _start;
+		events.read(end);
+		CounterValues& values = *resources;
+		for (std::size_t i = 0; i < counter_count; ++i) {
+			values.values[i] = end.since(_start, i);
+		}
+		values.measured = events.measured();
+		values.cpu_time = std::chrono::nanoseconds(end.cpu_time - _start.cpu_time);
+		_slot->values.add(values);
+		return false;
+	}
+
+public:
+	explicit PerfCounters(const char* name) : StaticResource<PerfCounters, CounterValues>(_values), _name(name){};
+	// Puts the counts of each context in values too
+	PerfCounters(CounterValues& values, const char* name)
+		: StaticResource<PerfCounters, CounterValues>(values), _name(name){};
+	// The block may hold a pointer to the counts inside
+	PerfCounters(const PerfCounters& other) = delete;
+
+	const char* context_name() const { return _name; }
+};
+
+};
+
+#endif
@@ -0,0 +1,451 @@
+#ifndef CONTEXTUAL_POOL_H
+#define CONTEXTUAL_POOL_H
+
+#include <contextual.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <vector>
+
+/*
+
+Pools of expensive objects, borrowed for the duration of a code block.
+
+A Pool keeps up to max_size objects, constructing them only when there are
+none idle to lend, and borrow() makes a resource manager that lends one to
+a code block and takes it back when the block is over:
+
+	Pool<Connection> connections(PoolOptions{2, 16}, [&]{
+		return std::make_unique<Connection>(address);
+	});
+
+	with {
+		connections.borrow()([&](Connection* connection){ ... })
+	};
+
+An object the code block threw from is discarded rather than lent again,
+as it may be left in any state; so is one the borrow was told to poison():
+
+	auto borrowed = connections.borrow();
+	with {
+		borrowed([&](Connection* connection){
+			if (!connection->ok()) {
+				borrowed.poison();
+			}
+		})
+	};
+
+When all max_size objects are lent, borrowing waits up to the wait of the
+options for one to come back, then throws a std::system_error with
+std::errc::timed_out.
+
+Idle objects are on a lock-free stack. In front of it each thread keeps
+the last few objects it gave back, which it borrows again without touching
+anything shared; they go back to the shared stack when the thread exits.
+The caches never strand an object: a borrower that finds the stack empty
+and the pool at max_size takes one from another thread's cache rather
+than waiting, and while a thread is waiting, objects given back skip the
+caches. The pool
+has to outlive every borrow, and the objects it destroys, including those
+in threads' caches, must not be in use.
+
+*/
+
+namespace Contextual {
+
+struct PoolOptions {
+	// Constructed up front
+	std::size_t min_size = 0;
+	// Never more at once, lent or idle
+	std::size_t max_size = 64;
+	// How long borrowing waits when all of them are lent
+	std::chrono::nanoseconds wait = std::chrono::seconds(1);
+	// Objects each thread keeps to borrow again, at most max_thread_cache
+	std::size_t thread_cache = 2;
+	// Whether an exception from the code block discards the object
+	bool poison_on_exception = true;
+};
+
+/************************************
+*									*
+* 	Lock-free stack of slots		*
+*									*
+************************************/
+
+// A Treiber stack of indices into an array of slots, linked through each
+// slot's next. The head packs the top index with a tag counting the
+// changes, so that a pop that read a top which was popped and pushed again
+// in the meantime fails rather than linking in a stale next.
+class _SlotStack {
+public:
+	static constexpr std::uint32_t none = UINT32_MAX;
+
+private:
+	std::atomic<std::uint64_t> _head{none};
+
+	static std::uint32_t _index(std::uint64_t head){ return static_cast<std::uint32_t>(head); }
+	static std::uint64_t _next(std::uint64_t head, std::uint32_t index){
+		return ((head >> 32) + 1) << 32 | index;
+	}
+
+public:
+	// Sequentially consistent, so that whoever pushed can then tell whether
+	// anybody is waiting without missing one who failed to pop
+	template <class slot>
+	void push(slot* slots, std::uint32_t index){
+		std::uint64_t head = _head.load(std::memory_order_relaxed);
+		do {
+			slots[index].next.store(_index(head), std::memory_order_relaxed);
+		} while (!_head.compare_exchange_weak(head, _next(head, index), std::memory_order_seq_cst,
+											  std::memory_order_relaxed));
+	}
+
+	template <class slot>
+	std::uint32_t pop(slot* slots){
+		std::uint64_t head = _head.load(std::memory_order_seq_cst);
+		while (_index(head) != none) {
+			std::uint32_t next = slots[_index(head)].next.load(std::memory_order_relaxed);
+			if (_head.compare_exchange_weak(head, _next(head, next), std::memory_order_seq_cst,
+											std::memory_order_seq_cst)) {
+				return _index(head);
+			}
+		}
+		return none;
+	}
+};
+
+/************************************
+*									*
+* 	Per-thread caches				*
+*									*
+************************************/
+
+// What the thread caches know of the pools they cache for
+class _PoolBase {
+public:
+	static constexpr std::size_t max_thread_cache = 8;
+
+	// Never reused, unlike the address of a pool
+	const std::uint64_t id;
+
+	_PoolBase() : id(_next_id().fetch_add(1, std::memory_order_relaxed) + 1){
+		std::lock_guard<std::mutex> hold(_registry_mutex());
+		_registry()[id] = this;
+	}
+	_PoolBase(const _PoolBase& other) = delete;
+
+	virtual ~_PoolBase(){
+		_unregister();
+	}
+
+	// Called by pools before they destroy anything, so that no exiting
+	// thread gives a slot back to a pool half destroyed
+	void _unregister(){
+		std::lock_guard<std::mutex> hold(_registry_mutex());
+		_registry().erase(id);
+	}
+
+	// Takes back a slot a thread cached, as the thread exits
+	virtual void _uncache(std::uint32_t index) = 0;
+
+	static std::atomic<std::uint64_t>& _next_id(){
+		static std::atomic<std::uint64_t> id{0};
+		return id;
+	}
+
+	static std::mutex& _registry_mutex(){
+		static std::mutex mutex;
+		return mutex;
+	}
+
+	// The pools that are alive, by id
+	static std::map<std::uint64_t, _PoolBase*>& _registry(){
+		static std::map<std::uint64_t, _PoolBase*> registry;
+		return registry;
+	}
+};
+
+// The slots a thread keeps for one pool
+struct _PoolCache {
+	std::uint64_t pool;
+	std::size_t count = 0;
+	std::uint32_t slots[_PoolBase::max_thread_cache];
+};
+
+class _PoolCaches {
+private:
+	std::vector<_PoolCache> _caches;
+	std::size_t _last = 0;
+
+public:
+	// Gives the cached slots back to the pools that are still alive
+	~_PoolCaches(){
+		std::lock_guard<std::mutex> hold(_PoolBase::_registry_mutex());
+		for (_PoolCache& cache : _caches) {
+			auto pool = _PoolBase::_registry().find(cache.pool);
+			if (pool != _PoolBase::_registry().end()) {
+				for (std::size_t i = 0; i < cache.count; ++i) {
+					pool->second->_uncache(cache.slots[i]);
+				}
+			}
+		}
+	}
+
+	static _PoolCaches& local(){
+		static thread_local _PoolCaches caches;
+		return caches;
+	}
+
+	_PoolCache& get(std::uint64_t pool){
+		if (_last < _caches.size() && _caches[_last].pool == pool) {
+			return _caches[_last];
+		}
+		for (std::size_t i = 0; i < _caches.size(); ++i) {
+			if (_caches[i].pool == pool) {
+				return _caches[_last = i];
+			}
+		}
+		// The cache of a pool that is gone, if any, is reused
+		{
+			std::lock_guard<std::mutex> hold(_PoolBase::_registry_mutex());
+			for (std::size_t i = 0; i < _caches.size(); ++i) {
+				if (!_PoolBase::_registry().count(_caches[i].pool)) {
+					_caches[i] = _PoolCache{pool};
+					return _caches[_last = i];
+				}
+			}
+		}
+		_caches.push_back(_PoolCache{pool});
+		return _caches[_last = _caches.size() - 1];
+	}
+};
+
+/************************************
+*									*
+* 	Pools							*
+*									*
+************************************/
+
+template <class value>
+class Pool;
+
+// Lends an object of a pool to a code block
+template <class value>
+class Borrow : public IResource<value> {
+private:
+	Pool<value>& _pool;
+	std::uint32_t _slot = _SlotStack::none;
+	bool _poisoned = false;
+
+	void enter() override {
+		_poisoned = false;
+		_slot = _pool._acquire();
+		this->resources = _pool._item(_slot);
+	}
+
+	bool exit(std::exception_ptr e) override {
+		bool poisoned = _poisoned || (e && _pool.options().poison_on_exception);
+		_pool._release(_slot, poisoned);
+		_slot = _SlotStack::none;
+		return false;
+	}
+
+public:
+	explicit Borrow(Pool<value>& pool) : _pool(pool){};
+
+	// Discards the object once the code block is over, rather than lending
+	// it again
+	void poison(){ _poisoned = true; }
+};
+
+template <class value>
+class Pool : public _PoolBase {
+private:
+	friend class Borrow<value>;
+
+	struct _Slot {
+		std::unique_ptr<value> item;
+		std::atomic<std::uint32_t> next{_SlotStack::none};
+		// Whether a thread's cache holds it, cleared by whoever takes it,
+		// the thread or another, so that a cache may hold slots since taken
+		std::atomic<bool> cached{false};
+	};
+
+	PoolOptions _options;
+	std::function<std::unique_ptr<value>()> _make;
+	std::unique_ptr<_Slot[]> _slots;
+	// Slots with an object to lend, and slots without one
+	_SlotStack _idle;
+	_SlotStack _empty;
+	std::atomic<std::size_t> _size{0};
+	std::atomic<std::uint64_t> _discarded{0};
+
+	// Only for borrowers that have to wait
+	std::mutex _mutex;
+	std::condition_variable _returned;
+	std::atomic<std::size_t> _waiters{0};
+
+	value* _item(std::uint32_t index){
+		return _slots[index].item.get();
+	}
+
+	// A slot from the cache of any thread, for when there are no others
+	std::uint32_t _steal(){
+		for (std::size_t i = 0; i < _options.max_size; ++i) {
+			if (_slots[i].cached.load(std::memory_order_seq_cst)
+				&& _slots[i].cached.exchange(false, std::memory_order_seq_cst)) {
+				return static_cast<std::uint32_t>(i);
+			}
+		}
+		return _SlotStack::none;
+	}
+
+	// An idle slot, or an empty one given an object, or one a thread
+	// cached, or none; locked when the caller holds the waiters' mutex
+	std::uint32_t _try_acquire(bool locked = false){
+		std::uint32_t index = _idle.pop(_slots.get());
+		if (index != _SlotStack::none) {
+			return index;
+		}
+		index = _empty.pop(_slots.get());
+		if (index != _SlotStack::none) {
+			try {
+				_slots[index].item = _make();
+			} catch (...) {
+				_empty.push(_slots.get(), index);
+				if (locked) {
+					_returned.notify_one();
+				} else {
+					_notify();
+				}
+				throw;
+			}
+			_size.fetch_add(1, std::memory_order_relaxed);
+			return index;
+		}
+		return _options.thread_cache ? _steal() : _SlotStack::none;
+	}
+
+	std::uint32_t _acquire(){
+		if (_options.thread_cache) {
+			_PoolCache& cache = _PoolCaches::local().get(id);
+			while (cache.count) {
+				std::uint32_t index = cache.slots[--cache.count];
+				if (_slots[index].cached.exchange(false, std::memory_order_acq_rel)) {
+					return index;
+				}
+			}
+		}
+		std::uint32_t index = _try_acquire();
+		if (index != _SlotStack::none) {
+			return index;
+		}
+		auto deadline = std::chrono::steady_clock::now() + _options.wait;
+		std::unique_lock<std::mutex> hold(_mutex);
+		_waiters.fetch_add(1, std::memory_order_seq_cst);
+		bool timed_out = false;
+		while (true) {
+			try {
+				index = _try_acquire(true);
+			} catch (...) {
+				_waiters.fetch_sub(1, std::memory_order_relaxed);
+				throw;
+			}
+			if (index != _SlotStack::none || timed_out) {
+				_waiters.fetch_sub(1, std::memory_order_relaxed);
+				if (index != _SlotStack::none) {
+					return index;
+				}
+				throw std::system_error(std::make_error_code(std::errc::timed_out), "pool exhausted");
+			}
+			// One last try once the time is up
+			timed_out = _returned.wait_until(hold, deadline) == std::cv_status::timeout;
+		}
+	}
+
+	void _release(std::uint32_t index, bool poisoned){
+		if (poisoned) {
+			_slots[index].item.reset();
+			_size.fetch_sub(1, std::memory_order_relaxed);
+			_discarded.fetch_add(1, std::memory_order_relaxed);
+			_empty.push(_slots.get(), index);
+			_notify();
+			return;
+		}
+		if (_options.thread_cache && _waiters.load(std::memory_order_seq_cst) == 0) {
+			_PoolCache& cache = _PoolCaches::local().get(id);
+			if (cache.count < _options.thread_cache) {
+				cache.slots[cache.count++] = index;
+				_slots[index].cached.store(true, std::memory_order_seq_cst);
+				// A borrower that started waiting meanwhile may have looked
+				// through the caches already, so the slot is taken back
+				if (_waiters.load(std::memory_order_seq_cst) == 0
+					|| !_slots[index].cached.exchange(false, std::memory_order_seq_cst)) {
+					return;
+				}
+				--cache.count;
+			}
+		}
+		_idle.push(_slots.get(), index);
+		_notify();
+	}
+
+	void _notify(){
+		if (_waiters.load(std::memory_order_seq_cst)) {
+			std::lock_guard<std::mutex> hold(_mutex);
+			_returned.notify_one();
+		}
+	}
+
+	void _uncache(std::uint32_t index) override {
+		if (_slots[index].cached.exchange(false, std::memory_order_acq_rel)) {
+			_idle.push(_slots.get(), index);
+			_notify();
+		}
+	}
+
+public:
+	explicit Pool(PoolOptions options = PoolOptions(),
+				  std::function<std::unique_ptr<value>()> make = []{ return std::make_unique<value>(); })
+		: _options(options), _make(std::move(make)){
+		_options.max_size = std::max<std::size_t>(std::min<std::size_t>(_options.max_size, _SlotStack::none - 1), 1);
+		_options.min_size = std::min(_options.min_size, _options.max_size);
+		_options.thread_cache = std::min(_options.thread_cache, max_thread_cache);
+		_slots.reset(new _Slot[_options.max_size]);
+		for (std::size_t i = _options.max_size; i-- > _options.min_size;) {
+			_empty.push(_slots.get(), static_cast<std::uint32_t>(i));
+		}
+		for (std::size_t i = _options.min_size; i-- > 0;) {
+			_slots[i].item = _make();
+			_size.fetch_add(1, std::memory_order_relaxed);
+			_idle.push(_slots.get(), static_cast<std::uint32_t>(i));
+		}
+	}
+
+	~Pool(){
+		_unregister();
+	}
+
+	Borrow<value> borrow(){
+		return Borrow<value>(*this);
+	}
+
+	const PoolOptions& options() const { return _options; }
+
+	// The objects that exist, lent or idle
+	std::size_t size() const { return _size.load(std::memory_order_relaxed); }
+
+	// The objects discarded as poisoned
+	std::uint64_t discarded() const { return _discarded.load(std::memory_order_relaxed); }
+};
+
+};
+
+#endif
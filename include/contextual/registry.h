@@ -0,0 +1,318 @@
+#ifndef CONTEXTUAL_REGISTRY_H
+#define CONTEXTUAL_REGISTRY_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+
+The bookkeeping shared by the statistics that each thread keeps for itself
+and any thread reads: those of named locks, latency histograms, folded
+stacks and performance counters.
+
+Each thread writes into a table of its own, without locks or atomic
+read-modify-writes, and the tables are only summed when the statistics are
+read. _ThreadTables keeps the tables of the threads alive, and has the
+table of a thread that exits fold what it counted into totals that outlive
+it. _NamedStatistics builds on it the usual case of counts per name, for a
+derived class to report:
+
+	class _Statistics : public _NamedStatistics<_Statistics, _Counts, Report> {
+	public:
+		static _Statistics& global(){ ... }
+	};
+
+	_Statistics::_Table::local().slot("name").values.add(...);
+
+where each thread's _Counts for a name add_to the Report they are summed
+into, and Report can subtract the totals that were counted before the last
+reset. Readers keep counting while the statistics are reset, so rather than
+clearing anything a reset records where the counts stand.
+
+A thread finds the slot of a name by the name's address, in a small hash
+table, and only compares the text to make sure the address was not reused
+for another name, which derived classes whose names are all interned skip.
+
+*/
+
+namespace Contextual {
+
+// Adds to a counter that only the calling thread writes, so a load and a
+// store do where a read-modify-write would otherwise be needed; atomic only
+// so that readers see whole values
+inline void _add_counter(std::atomic<std::uint64_t>& counter, std::uint64_t n){
+	counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/************************************
+*									*
+* 	Tables of the live threads		*
+*									*
+************************************/
+
+template <class table>
+class _ThreadTables {
+private:
+	std::mutex _mutex;
+	std::vector<table*> _tables;
+
+public:
+	// Held while reading the tables, or the totals they fold into
+	std::mutex& mutex(){ return _mutex; }
+
+	void add(table& t){
+		std::lock_guard<std::mutex> hold(_mutex);
+		_tables.push_back(&t);
+	}
+
+	// Takes out the table of a thread that exits, once retire, called with
+	// the mutex held, has folded it into the totals
+	template <class function>
+	void remove(table& t, function&& retire){
+		std::lock_guard<std::mutex> hold(_mutex);
+		_tables.erase(std::find(_tables.begin(), _tables.end(), &t));
+		retire();
+	}
+
+	// The caller holds the mutex
+	const std::vector<table*>& tables() const { return _tables; }
+};
+
+/************************************
+*									*
+* 	Counts per name					*
+*									*
+************************************/
+
+// Nothing shared by the threads counting under a name but the name
+struct _Unshared {
+	void reset(){}
+};
+
+template <class derived, class counts, class totals, class shared = _Unshared>
+class _NamedStatistics {
+public:
+	// Names a thread counts under at most; beyond them, everything is
+	// counted under overflow_name. Either can be hidden by the derived class.
+	static constexpr std::size_t max_names = 1024;
+	static constexpr const char* overflow_name = "(other names)";
+	// Whether every name counted is interned, so that names are the same
+	// exactly when their addresses are
+	static constexpr bool interned_names = false;
+
+	// What every thread shares about a name
+	struct _Site {
+		std::string name;
+		shared state;
+		// The counts of threads that have exited, and of everything before
+		// the last reset
+		totals retired;
+		totals baseline;
+	};
+
+	// One thread's counts for one name
+	struct _Slot {
+		_Site* site;
+		_Slot* next;
+		counts values;
+	};
+
+	// A thread's slots, in a list that only ever grows at the head so that
+	// it can be walked by readers while the thread adds to it
+	class _Table {
+	private:
+		// Where the slot of a name was last found, by the address of the name
+		struct _Indexed {
+			const char* name;
+			_Slot* slot;
+		};
+
+		// Big enough for every name and overflowing names besides; beyond
+		// that the index is cleared rather than grown
+		static constexpr std::size_t _max_index(){
+			std::size_t size = 16;
+			while (size < 4 * (derived::max_names + 1)) {
+				size *= 2;
+			}
+			return size;
+		}
+
+		std::atomic<_Slot*> _head{nullptr};
+		_Slot* _overflow = nullptr;
+		std::size_t _names = 0;
+		// Open addressing, in front of the list
+		std::vector<_Indexed> _index;
+		std::size_t _indexed = 0;
+
+		static bool _matches(const _Slot& slot, const char* name){
+			return std::strcmp(slot.site->name.c_str(), name) == 0;
+		}
+
+		std::size_t _position(const char* name) const {
+			std::uint64_t hash = reinterpret_cast<std::uintptr_t>(name) * UINT64_C(0x9e3779b97f4a7c15);
+			return static_cast<std::size_t>(hash ^ hash >> 32) & (_index.size() - 1);
+		}
+
+		// The entry of a name in the index, or the empty one it would take
+		_Indexed& _entry(const char* name){
+			std::size_t i = _position(name);
+			while (_index[i].name && _index[i].name != name) {
+				i = (i + 1) & (_index.size() - 1);
+			}
+			return _index[i];
+		}
+
+		void _remember(const char* name, _Slot& slot){
+			if (2 * (_indexed + 1) > _index.size()) {
+				std::vector<_Indexed> old = std::move(_index);
+				_index.assign(std::min(std::max<std::size_t>(2 * old.size(), 16), _max_index()), _Indexed{nullptr, nullptr});
+				_indexed = 0;
+				// Rehashed when grown, and forgotten when it cannot grow
+				if (_index.size() > old.size()) {
+					for (const _Indexed& entry : old) {
+						if (entry.name) {
+							_entry(entry.name) = entry;
+							++_indexed;
+						}
+					}
+				}
+			}
+			_Indexed& entry = _entry(name);
+			if (!entry.name) {
+				++_indexed;
+			}
+			entry = _Indexed{name, &slot};
+		}
+
+		// The slot for a name by its text, made if there is none
+		_Slot& _search(const char* name){
+			_Slot* first = _head.load(std::memory_order_relaxed);
+			for (_Slot* s = first; s; s = s->next) {
+				if (_matches(*s, name)) {
+					return *s;
+				}
+			}
+			if (_names == derived::max_names) {
+				if (!_overflow) {
+					_overflow = &_create(derived::overflow_name, first);
+				}
+				return *_overflow;
+			}
+			++_names;
+			return _create(name, first);
+		}
+
+		_Slot& _create(const char* name, _Slot* first){
+			_NamedStatistics& statistics = derived::global();
+			std::lock_guard<std::mutex> hold(statistics._tables.mutex());
+			_Site& site = statistics._sites[name];
+			site.name = name;
+			_Slot* created = new _Slot{&site, first};
+			_head.store(created, std::memory_order_release);
+			return *created;
+		}
+
+	public:
+		_Table(){
+			_NamedStatistics& statistics = derived::global();
+			statistics._tables.add(*this);
+		}
+		_Table(const _Table& other) = delete;
+
+		// Folds this thread's counts into the sites
+		~_Table(){
+			_NamedStatistics& statistics = derived::global();
+			statistics._tables.remove(*this, [&]{
+				_Slot* slot = _head.load(std::memory_order_relaxed);
+				while (slot) {
+					slot->values.add_to(slot->site->retired);
+					_Slot* next = slot->next;
+					delete slot;
+					slot = next;
+				}
+			});
+		}
+
+		static _Table& local(){
+			static thread_local _Table table;
+			return table;
+		}
+
+		const _Slot* first() const {
+			return _head.load(std::memory_order_acquire);
+		}
+
+		// The slot for a name, found by its address. Unless the derived
+		// class has names interned, the address of a name that is gone may
+		// have been reused for another, so the text is checked too, and
+		// searched for when it differs.
+		_Slot& slot(const char* name){
+			if (!_index.empty()) {
+				_Indexed& entry = _entry(name);
+				if (entry.name && (derived::interned_names || _matches(*entry.slot, name))) {
+					return *entry.slot;
+				}
+			}
+			_Slot& found = _search(name);
+			_remember(name, found);
+			return found;
+		}
+	};
+
+protected:
+	_ThreadTables<_Table> _tables;
+	// A map, so that sites never move
+	std::map<std::string, _Site> _sites;
+
+	// Everything counted so far, per site; the caller holds the mutex
+	std::map<_Site*, totals> _totals(){
+		std::map<_Site*, totals> sums;
+		for (auto& [name, site] : _sites) {
+			sums[&site] = site.retired;
+		}
+		for (_Table* table : _tables.tables()) {
+			for (const _Slot* slot = table->first(); slot; slot = slot->next) {
+				slot->values.add_to(sums[slot->site]);
+			}
+		}
+		return sums;
+	}
+
+	_NamedStatistics() = default;
+
+public:
+	_NamedStatistics(const _NamedStatistics& other) = delete;
+
+	// Everything counted since the last reset, per site
+	std::vector<std::pair<const _Site*, totals>> since_reset(){
+		std::lock_guard<std::mutex> hold(_tables.mutex());
+		std::vector<std::pair<const _Site*, totals>> sums;
+		for (auto& [site, total] : _totals()) {
+			total.subtract(site->baseline);
+			sums.emplace_back(site, std::move(total));
+		}
+		return sums;
+	}
+
+	// Threads keep counting while this runs, so rather than clearing their
+	// slots it records where they stand and later reads subtract it
+	void reset(){
+		std::lock_guard<std::mutex> hold(_tables.mutex());
+		for (auto& [site, total] : _totals()) {
+			site->baseline = std::move(total);
+			site->state.reset();
+		}
+	}
+};
+
+};
+
+#endif
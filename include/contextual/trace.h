@@ -0,0 +1,289 @@
+#ifndef CONTEXTUAL_TRACE_H
+#define CONTEXTUAL_TRACE_H
+
+#include <contextual.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+
+Timelines of contexts in the Chrome trace event format, which Perfetto and
+chrome://tracing load.
+
+TraceRecorder is a context observer that records each context as an event
+with its name, thread, start, duration and whether exit saw an exception.
+A TraceFile writes them out, when flushed or, given an interval, from a
+thread of its own:
+
+	TraceFile trace("contexts.json", std::chrono::seconds(1));
+
+Each thread records into a ring buffer of its own that only the flusher
+reads, without locks; if the flusher falls behind, events are dropped and
+counted rather than waited for. To leave tracing on in production, build
+with the sampled instrumentation policy, which picks whole trees of nested
+contexts so that sampled timelines still nest.
+
+*/
+
+namespace Contextual {
+
+struct TraceEvent {
+	// Interned by the hook, so it lasts until the events are written
+	const char* name;
+	// steady_clock nanoseconds
+	std::int64_t begin;
+	std::int64_t end;
+	// Numbered from 1 in the order threads first recorded
+	std::uint32_t thread;
+	bool exception;
+	bool enter_failed;
+};
+
+/************************************
+*									*
+* 	Recording						*
+*									*
+************************************/
+
+class TraceRecorder : public ContextObserver {
+public:
+	static constexpr std::size_t buffer_capacity = 4096;
+
+private:
+	// A ring buffer with one writer, its thread, and one reader, the flusher
+	class _Buffer {
+	private:
+		TraceEvent _events[buffer_capacity];
+		std::atomic<std::uint64_t> _head{0};
+		std::atomic<std::uint64_t> _tail{0};
+
+	public:
+		std::uint32_t thread;
+		std::atomic<std::uint64_t> dropped{0};
+
+		explicit _Buffer(std::uint32_t t) : thread(t){};
+
+		void push(const TraceEvent& event){
+			std::uint64_t head = _head.load(std::memory_order_relaxed);
+			if (head - _tail.load(std::memory_order_acquire) == buffer_capacity) {
+				dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				return;
+			}
+			_events[head % buffer_capacity] = event;
+			_head.store(head + 1, std::memory_order_release);
+		}
+
+		std::size_t drain(std::vector<TraceEvent>& into){
+			std::uint64_t tail = _tail.load(std::memory_order_relaxed);
+			std::uint64_t head = _head.load(std::memory_order_acquire);
+			for (std::uint64_t i = tail; i < head; ++i) {
+				into.push_back(_events[i % buffer_capacity]);
+			}
+			_tail.store(head, std::memory_order_release);
+			return static_cast<std::size_t>(head - tail);
+		}
+	};
+
+	class _Local {
+	public:
+		_Buffer* buffer;
+
+		_Local(){
+			TraceRecorder& recorder = TraceRecorder::global();
+			std::lock_guard<std::mutex> hold(recorder._mutex);
+			buffer = new _Buffer(++recorder._threads);
+			recorder._buffers.push_back(buffer);
+		}
+
+		// Keeps what the flusher has not read yet
+		~_Local(){
+			TraceRecorder& recorder = TraceRecorder::global();
+			std::lock_guard<std::mutex> hold(recorder._mutex);
+			buffer->drain(recorder._retired);
+			recorder._dropped += buffer->dropped.load(std::memory_order_relaxed);
+			recorder._buffers.erase(std::find(recorder._buffers.begin(), recorder._buffers.end(), buffer));
+			delete buffer;
+		}
+
+		static _Buffer& get(){
+			static thread_local _Local local;
+			return *local.buffer;
+		}
+	};
+
+	std::mutex _mutex;
+	std::vector<_Buffer*> _buffers;
+	std::vector<TraceEvent> _retired;
+	std::uint32_t _threads = 0;
+	std::uint64_t _dropped = 0;
+
+	TraceRecorder(){
+		add_observer(*this);
+	}
+
+public:
+	TraceRecorder(const TraceRecorder& other) = delete;
+	~TraceRecorder(){
+		remove_observer(*this);
+	}
+
+	// The recorder of this process, which starts recording on first use
+	static TraceRecorder& global(){
+		static TraceRecorder recorder;
+		return recorder;
+	}
+
+	void end(const ContextSample& sample) override {
+		_Buffer& buffer = _Local::get();
+		buffer.push(TraceEvent{sample.name, sample.begin, sample.end, buffer.thread,
+							   sample.exception, sample.enter_failed});
+	}
+
+	// Moves every event recorded so far into the vector, returning how many
+	std::size_t drain(std::vector<TraceEvent>& into){
+		std::lock_guard<std::mutex> hold(_mutex);
+		std::size_t count = _retired.size();
+		into.insert(into.end(), _retired.begin(), _retired.end());
+		_retired.clear();
+		for (_Buffer* buffer : _buffers) {
+			count += buffer->drain(into);
+		}
+		return count;
+	}
+
+	// Events lost to full buffers
+	std::uint64_t dropped(){
+		std::lock_guard<std::mutex> hold(_mutex);
+		std::uint64_t dropped = _dropped;
+		for (_Buffer* buffer : _buffers) {
+			dropped += buffer->dropped.load(std::memory_order_relaxed);
+		}
+		return dropped;
+	}
+};
+
+/************************************
+*									*
+* 	Writing trace files				*
+*									*
+************************************/
+
+inline void _write_json_string(std::ostream& out, const std::string& s){
+	out << '"';
+	for (char c : s) {
+		if (c == '"' || c == '\\') {
+			out << '\\' << c;
+		} else if (static_cast<unsigned char>(c) < 0x20) {
+			out << ' ';
+		} else {
+			out << c;
+		}
+	}
+	out << '"';
+}
+
+// Writes an event as a complete ("X") trace event, with times in
+// microseconds
+inline void write_trace_event(std::ostream& out, const TraceEvent& event){
+	out << "{\"name\": ";
+	_write_json_string(out, readable_name(event.name));
+	out << ", \"cat\": \"context\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread
+		<< ", \"ts\": " << event.begin / 1000 << '.' << std::to_string(1000 + event.begin % 1000).substr(1)
+		<< ", \"dur\": " << (event.end - event.begin) / 1000 << '.'
+		<< std::to_string(1000 + (event.end - event.begin) % 1000).substr(1)
+		<< ", \"args\": {\"exception\": " << (event.exception ? "true" : "false")
+		<< ", \"enter_failed\": " << (event.enter_failed ? "true" : "false") << "}}";
+}
+
+// A trace file, which is complete JSON once it is closed. Until then it is
+// the unterminated form the viewers also accept, so the trace of a process
+// that crashed can still be loaded.
+class TraceFile {
+private:
+	std::ofstream _out;
+	std::mutex _mutex;
+	bool _first = true;
+	bool _closed = false;
+	std::vector<TraceEvent> _events;
+
+	std::mutex _stop_lock;
+	std::condition_variable _stop_changed;
+	bool _stopping = false;
+	std::thread _flusher;
+
+public:
+	// Starts the recorder, if it is not already
+	explicit TraceFile(const std::string& path) : _out(path){
+		TraceRecorder::global();
+		_out << "{\"traceEvents\": [";
+		_out.flush();
+	}
+
+	// Flushes every interval from a thread of its own
+	template <class rep, class period>
+	TraceFile(const std::string& path, std::chrono::duration<rep, period> interval) : TraceFile(path){
+		_flusher = std::thread([this, interval]{
+			std::unique_lock<std::mutex> hold(_stop_lock);
+			while (!_stop_changed.wait_for(hold, interval, [this]{ return _stopping; })) {
+				hold.unlock();
+				flush();
+				hold.lock();
+			}
+		});
+	}
+
+	TraceFile(const TraceFile& other) = delete;
+	~TraceFile(){
+		close();
+	}
+
+	bool good() const { return _out.good(); }
+
+	// Writes the events recorded since the last flush
+	std::size_t flush(){
+		std::lock_guard<std::mutex> hold(_mutex);
+		if (_closed) {
+			return 0;
+		}
+		_events.clear();
+		std::size_t count = TraceRecorder::global().drain(_events);
+		for (const TraceEvent& event : _events) {
+			_out << (_first ? "\n" : ",\n");
+			write_trace_event(_out, event);
+			_first = false;
+		}
+		_out.flush();
+		return count;
+	}
+
+	void close(){
+		if (_flusher.joinable()) {
+			{
+				std::lock_guard<std::mutex> hold(_stop_lock);
+				_stopping = true;
+			}
+			_stop_changed.notify_all();
+			_flusher.join();
+		}
+		flush();
+		std::lock_guard<std::mutex> hold(_mutex);
+		if (!_closed) {
+			_out << "\n]}\n";
+			_out.close();
+			_closed = true;
+		}
+	}
+};
+
+};
+
+#endif
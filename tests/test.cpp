@@ -1,3 +1,31 @@
 #define CATCH_CONFIG_MAIN
+// The bundled Catch sizes its signal stack with SIGSTKSZ, which newer glibc
+// no longer defines as a constant.
+#define CATCH_CONFIG_NO_POSIX_SIGNALS
+// Named locks and contexts in the tests are instrumented, so that their
+// statistics can be checked; example.cpp builds without it.
+#define CONTEXTUAL_INSTRUMENT
+// The tests count allocations, so this is where operator new is replaced
+#define CONTEXTUAL_ALLOCATION_IMPLEMENTATION
 #include "catch.hpp"
-#include "test_contextual_basic.h"
\ No newline at end of file
+#include "test_contextual_basic.h"
+#include "test_contextual_static.h"
+#include "test_contextual_data.h"
+#include "test_contextual_storage.h"
+#include "test_contextual_expected.h"
+#include "test_contextual_result.h"
+#include "test_contextual_all.h"
+#include "test_contextual_exit_stack.h"
+#include "test_contextual_coroutine.h"
+#include "test_contextual_generator.h"
+#include "test_contextual_adapters.h"
+#include "test_contextual_arena.h"
+#include "test_contextual_lock.h"
+#include "test_contextual_histogram.h"
+#include "test_contextual_instrument.h"
+#include "test_contextual_trace.h"
+#include "test_contextual_folded.h"
+#include "test_contextual_perf.h"
+#include "test_contextual_allocation.h"
+#include "test_contextual_pool.h"
+#include "test_contextual_linger.h"
@@ -0,0 +1,137 @@
+#include <contextual/adapters.h>
+#include <mutex>
+#include <type_traits>
+
+using namespace Contextual;
+
+
+TEST_CASE("Test resource managers from a pair of functions", "[adapters]"){
+	IData data{"admin", "password123"};
+	std::string masked = "xxxxxxxxx";
+
+	SECTION("Test no vtable is needed"){
+		auto resource = make_resource(data,
+			[](IData*){},
+			[](IData*){}
+		);
+		REQUIRE_FALSE(std::is_polymorphic<decltype(resource)>::value);
+	}
+
+	SECTION("Test resource acquisition and release"){
+		with {
+			make_resource(data,
+				[&](IData* d){ std::swap(masked, d->password); },
+				[&](IData* d){ std::swap(masked, d->password); d->logged_in = true; }
+			)(
+				[&](IData* resource){
+					REQUIRE(resource == &data);
+					REQUIRE(resource->password == "xxxxxxxxx");
+				}
+			)
+		};
+
+		REQUIRE(data.password == "password123");
+		REQUIRE(data.logged_in == true);
+	}
+
+	SECTION("Test exceptions propagate unless exit suppresses them"){
+		auto propagating = [&]{
+			with {
+				make_resource(data,
+					[](IData*){},
+					[](IData* d){ d->logged_in = true; }
+				)(
+					[&](IData*){ throw std::runtime_error("propagated"); }
+				)
+			};
+		};
+		REQUIRE_THROWS_AS(propagating(), std::runtime_error);
+		REQUIRE(data.logged_in == true);
+
+		std::exception_ptr seen;
+		with {
+			make_resource(data,
+				[](IData*){},
+				[&](IData*, std::exception_ptr e){ seen = e; return true; }
+			)(
+				[&](IData*){ throw std::runtime_error("suppressed"); }
+			)
+		};
+		REQUIRE(seen);
+	}
+
+	SECTION("Test temporary data is owned"){
+		with {
+			make_resource(IData{"guest", "secret"},
+				[](IData* d){ d->logged_in = true; },
+				[](IData*){}
+			)(
+				[&](IData* resource){
+					REQUIRE(resource->username == "guest");
+					REQUIRE(resource->logged_in == true);
+				}
+			)
+		};
+	}
+
+	SECTION("Test noexcept is detected"){
+		int count = 0;
+		auto enter = [](int* c) noexcept { ++*c; };
+		auto exit = [](int* c) noexcept { --*c; };
+		auto block = [](int*) noexcept -> void {};
+		using Counted = decltype(make_resource(count, enter, exit));
+		REQUIRE(is_nothrow_context_v<Counted, decltype(block)>);
+
+		auto throwing_exit = [](int*){};
+		using Throwing = decltype(make_resource(count, enter, throwing_exit));
+		REQUIRE_FALSE(is_nothrow_context_v<Throwing, decltype(block)>);
+
+		with { make_resource(count, enter, exit)(block) };
+		REQUIRE(count == 0);
+	}
+}
+
+TEST_CASE("Test resource managers from RAII types", "[adapters]"){
+	std::mutex first;
+	std::mutex second;
+
+	SECTION("Test the guard lives for the code block"){
+		with {
+			guard_resource<std::unique_lock<std::mutex>>(first)(
+				[&](std::unique_lock<std::mutex>* lock){
+					REQUIRE(lock->owns_lock());
+					REQUIRE_FALSE(first.try_lock());
+				}
+			)
+		};
+
+		REQUIRE(first.try_lock());
+		first.unlock();
+	}
+
+	SECTION("Test the guard is released when the block throws"){
+		auto throwing = [&]{
+			with {
+				guard_resource<std::scoped_lock<std::mutex, std::mutex>>(first, second)(
+					[&](auto){ throw std::runtime_error("released"); }
+				)
+			};
+		};
+		REQUIRE_THROWS_AS(throwing(), std::runtime_error);
+
+		REQUIRE(first.try_lock());
+		REQUIRE(second.try_lock());
+		first.unlock();
+		second.unlock();
+	}
+
+	SECTION("Test constructor arguments are forwarded"){
+		with {
+			guard_resource<std::unique_lock<std::mutex>>(first, std::defer_lock)(
+				[&](std::unique_lock<std::mutex>* lock){
+					REQUIRE_FALSE(lock->owns_lock());
+				}
+			)
+		};
+	}
+}
@@ -0,0 +1,146 @@
+#include <contextual.h>
+#include <vector>
+
+using namespace Contextual;
+
+
+namespace Contextual {
+
+	// Logs the order of enter and exit calls
+	class Step : public StaticResource<Step, std::vector<std::string>> {
+	private:
+		friend struct ContextAccess;
+		std::string name;
+		bool fail_enter = false;
+		bool suppress = false;
+		bool fail_exit = false;
+		void enter() {
+			if (fail_enter) {
+				throw std::runtime_error(name);
+			}
+			resources->push_back("enter " + name);
+		}
+
+		bool exit(std::exception_ptr e) {
+			resources->push_back((e ? "error exit " : "exit ") + name);
+			if (fail_exit) {
+				throw std::logic_error(name);
+			}
+			return suppress;
+		}
+	public:
+		Step(std::vector<std::string> &log, std::string name, bool fail_enter=false,
+			 bool suppress=false, bool fail_exit=false): StaticResource<Step, std::vector<std::string>>(log),
+														 name(name), fail_enter(fail_enter),
+														 suppress(suppress), fail_exit(fail_exit){};
+	};
+
+};
+
+
+TEST_CASE("Test several resource managers in one context", "[all]"){
+	std::vector<std::string> log;
+	IData data{"admin", "password123"};
+
+	SECTION("Test each block argument is the data of one resource manager"){
+		LockData lock;
+		with {
+			with_all(Resource(data), Lock(lock), StaticPassword(data))(
+				[&](IData* first, LockData* second, IData* third){
+					REQUIRE(first == &data);
+					REQUIRE(second->held);
+					REQUIRE(third == &data);
+					// masked twice over
+					REQUIRE(data.password == "xxxxxxxxx");
+				}
+			)
+		};
+		REQUIRE_FALSE(lock.held);
+		REQUIRE(data.password == "password123");
+	}
+
+	SECTION("Test enter in order and exit in reverse"){
+		with {
+			with_all(Step(log, "a"), Step(log, "b"), Step(log, "c"))(
+				[&](auto a, auto b, auto c){
+					log.push_back("block");
+				}
+			)
+		};
+		REQUIRE(log == std::vector<std::string>{"enter a", "enter b", "enter c", "block",
+												 "exit c", "exit b", "exit a"});
+	}
+
+	SECTION("Test a failed enter exits the ones already entered"){
+		REQUIRE_THROWS_AS(with {
+			with_all(Step(log, "a"), Step(log, "b"), Step(log, "c", true))(
+				[&](auto a, auto b, auto c){
+					log.push_back("block");
+				}
+			)
+		}, std::runtime_error);
+		REQUIRE(log == std::vector<std::string>{"enter a", "enter b", "error exit b", "error exit a"});
+	}
+
+	SECTION("Test a failed enter suppressed by one already entered skips the block"){
+		with {
+			with_all(Step(log, "a"), Step(log, "b", false, true), Step(log, "c", true))(
+				[&](auto a, auto b, auto c){
+					log.push_back("block");
+				}
+			)
+		};
+		REQUIRE(log == std::vector<std::string>{"enter a", "enter b", "error exit b", "exit a"});
+	}
+
+	SECTION("Test a failed enter whose unwinding throws propagates the new exception"){
+		REQUIRE_THROWS_AS(with {
+			with_all(Step(log, "a", false, false, true), Step(log, "b", true))(
+				[&](auto a, auto b){}
+			)
+		}, std::logic_error);
+		REQUIRE(log == std::vector<std::string>{"enter a", "error exit a"});
+	}
+
+	SECTION("Test a group can be entered again after a failed enter"){
+		Step a(log, "a");
+		Step c(log, "c", true);
+		auto group = with_all(a, c);
+		for (int i = 0; i < 2; ++i) {
+			REQUIRE_THROWS_AS(with { group() }, std::runtime_error);
+		}
+		REQUIRE(log == std::vector<std::string>{"enter a", "error exit a", "enter a", "error exit a"});
+	}
+
+	SECTION("Test exits after a suppressing one see no exception"){
+		with {
+			with_all(Step(log, "a"), Step(log, "b", false, true), Step(log, "c"))(
+				[&](auto a, auto b, auto c){
+					throw std::runtime_error("block");
+				}
+			)
+		};
+		REQUIRE(log == std::vector<std::string>{"enter a", "enter b", "enter c",
+												 "error exit c", "error exit b", "exit a"});
+	}
+
+	SECTION("Test an exit that throws replaces the exception"){
+		REQUIRE_THROWS_AS(with {
+			with_all(Step(log, "a"), Step(log, "b", false, false, true))(
+				[&](auto a, auto b){}
+			)
+		}, std::logic_error);
+		REQUIRE(log == std::vector<std::string>{"enter a", "enter b", "exit b", "error exit a"});
+	}
+
+	SECTION("Test a group of noexcept contexts cannot throw"){
+		auto block = [&](int* a, int* b) noexcept {};
+		int first = 0, second = 0;
+		REQUIRE(noexcept(ContextAccess::enter(std::declval<decltype(with_all(Counter(first), Counter(second)))&>())));
+		with {
+			with_all(Counter(first), Counter(second))(block)
+		};
+		REQUIRE(first == 0);
+		REQUIRE(second == 0);
+	}
+}
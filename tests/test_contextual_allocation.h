@@ -0,0 +1,153 @@
+#include <contextual/allocation.h>
+#include <memory>
+#include <new>
+#include <vector>
+
+using namespace Contextual;
+
+
+namespace {
+
+	const char* VIOLATION_CONTEXT = nullptr;
+	std::size_t VIOLATIONS = 0;
+
+	void record_violation(const char* context, std::size_t size){
+		VIOLATION_CONTEXT = context;
+		++VIOLATIONS;
+		// The handler may allocate
+		std::vector<int> log(size);
+	}
+
+	void refuse_violation(const char* context, std::size_t size){
+		throw std::bad_alloc();
+	}
+
+};
+
+TEST_CASE("Test allocation accounting", "[allocation]"){
+	REQUIRE(allocation_accounting());
+
+	SECTION("Test the allocations of a block are counted"){
+		AllocationCounts counts;
+		with {
+			CountAllocations(counts)([&](AllocationCounts*){
+				std::vector<int> numbers(1000);
+				auto number = std::make_unique<long>(7);
+			})
+		};
+		REQUIRE(counts.allocations == 2);
+		REQUIRE(counts.deallocations == 2);
+		REQUIRE(counts.bytes == 1000 * sizeof(int) + sizeof(long));
+		REQUIRE(counts.peak >= 1000 * sizeof(int) + sizeof(long));
+	}
+
+	SECTION("Test the peak is of what was held at once, nested or not"){
+		AllocationCounts outer;
+		AllocationCounts inner;
+		std::vector<char> kept;
+		with {
+			CountAllocations(outer)([&](AllocationCounts*){
+				{
+					std::vector<char> big(1 << 20);
+				}
+				with {
+					CountAllocations(inner)([&](AllocationCounts*){
+						kept.resize(1 << 10);
+					})
+				};
+			})
+		};
+		REQUIRE(inner.allocations == 1);
+		REQUIRE(inner.deallocations == 0);
+		REQUIRE(inner.peak >= 1 << 10);
+		REQUIRE(inner.peak < 1 << 20);
+		REQUIRE(outer.allocations == 2);
+		REQUIRE(outer.peak >= 1 << 20);
+	}
+
+	SECTION("Test the thread's totals"){
+		AllocationCounts before = thread_allocations();
+		delete new int(1);
+		AllocationCounts after = thread_allocations();
+		REQUIRE(after.allocations - before.allocations == 1);
+		REQUIRE(after.deallocations - before.deallocations == 1);
+	}
+}
+
+TEST_CASE("Test allocation-free contexts", "[allocation]"){
+	VIOLATIONS = 0;
+	VIOLATION_CONTEXT = nullptr;
+	AllocationViolationHandler previous = set_allocation_violation_handler(&record_violation);
+	int data = 0;
+
+	SECTION("Test a context does not allocate to run its code block"){
+		auto nested = [&]{
+			with {
+				Named(data, "test.allocation.nested")([&](int* d){
+					++*d;
+				})
+			};
+		};
+		// Observers may allocate the first time they see a context
+		nested();
+		AllocationCounts counts;
+		with {
+			AllocationFree(counts, "test.allocation.free")([&](AllocationCounts*){
+				nested();
+			})
+		};
+		REQUIRE(VIOLATIONS == 0);
+		REQUIRE(counts.allocations == 0);
+		REQUIRE(data == 2);
+	}
+
+	SECTION("Test allocations are handed to the handler, which may let them through"){
+		AllocationCounts counts;
+		with {
+			AllocationFree(counts, "test.allocation.free")([&](AllocationCounts*){
+				delete new int(1);
+			})
+		};
+		REQUIRE(VIOLATIONS == 1);
+		REQUIRE(std::string(VIOLATION_CONTEXT) == "test.allocation.free");
+		// The handler's own allocation is not a violation, but is counted
+		REQUIRE(counts.allocations == 2);
+		delete new int(1);
+		REQUIRE(VIOLATIONS == 1);
+	}
+
+	SECTION("Test the handler can refuse allocations"){
+		set_allocation_violation_handler(&refuse_violation);
+		bool refused = false;
+		with {
+			AllocationFree("test.allocation.refused")([&](AllocationCounts*){
+				try {
+					delete new int(1);
+				} catch (const std::bad_alloc&) {
+					refused = true;
+				}
+				int* nothrow = new (std::nothrow) int(1);
+				refused = refused && nothrow == nullptr;
+			})
+		};
+		REQUIRE(refused);
+		// Allowed again once the context is over
+		delete new int(1);
+	}
+
+	SECTION("Test allocations are allowed again when the block throws"){
+		REQUIRE_THROWS_AS(
+			with {
+				AllocationFree("test.allocation.throws")([&](AllocationCounts*){
+					// Not a std::runtime_error, whose message is allocated
+					throw 1;
+				})
+			},
+			int
+		);
+		delete new int(1);
+		REQUIRE(VIOLATIONS == 0);
+	}
+
+	set_allocation_violation_handler(previous);
+}
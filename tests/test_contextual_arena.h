@@ -0,0 +1,132 @@
+#include <contextual/arena.h>
+#include <memory_resource>
+#include <thread>
+#include <vector>
+
+using namespace Contextual;
+
+
+TEST_CASE("Test arenas", "[arena]"){
+	std::pmr::memory_resource* outside = current_memory_resource();
+
+	SECTION("Test the arena is the current memory resource in the block"){
+		with {
+			Arena<>()(
+				[&](std::pmr::memory_resource* arena){
+					REQUIRE(current_memory_resource() == arena);
+					REQUIRE(std::pmr::get_default_resource() != arena);
+
+					std::pmr::vector<int> numbers(arena);
+					for (int i = 0; i < 1000; ++i) {
+						numbers.push_back(i);
+					}
+					REQUIRE(numbers.back() == 999);
+				}
+			)
+		};
+
+		REQUIRE(current_memory_resource() == outside);
+	}
+
+	SECTION("Test nested arenas"){
+		with {
+			Arena<>()(
+				[&](std::pmr::memory_resource* outer){
+					with {
+						Arena<>()(
+							[&](std::pmr::memory_resource* inner){
+								REQUIRE(inner != outer);
+								REQUIRE(current_memory_resource() == inner);
+							}
+						)
+					};
+					REQUIRE(current_memory_resource() == outer);
+				}
+			)
+		};
+
+		REQUIRE(current_memory_resource() == outside);
+	}
+
+	SECTION("Test the previous resource is restored when the block throws"){
+		auto throwing = [&]{
+			with {
+				Arena<>()(
+					[&](std::pmr::memory_resource*){ throw std::runtime_error("arena"); }
+				)
+			};
+		};
+		REQUIRE_THROWS_AS(throwing(), std::runtime_error);
+		REQUIRE(current_memory_resource() == outside);
+	}
+
+	SECTION("Test allocations fitting the buffer do not reach the cache"){
+		std::size_t allocations = ArenaBlockCache::local().allocations();
+		with {
+			Arena<1024>()(
+				[&](std::pmr::memory_resource* arena){
+					REQUIRE(arena->allocate(512) != nullptr);
+				}
+			)
+		};
+
+		REQUIRE(ArenaBlockCache::local().allocations() == allocations);
+	}
+
+	SECTION("Test arena blocks are reused"){
+		auto fill = [&]{
+			with {
+				Arena<>()(
+					[&](std::pmr::memory_resource* arena){
+						std::pmr::vector<char> bytes(arena);
+						bytes.resize(100000);
+					}
+				)
+			};
+		};
+		fill();
+		std::size_t allocations = ArenaBlockCache::local().allocations();
+		for (int i = 0; i < 10; ++i) {
+			fill();
+		}
+
+		REQUIRE(ArenaBlockCache::local().allocations() == allocations);
+	}
+
+	SECTION("Test replacing the process default"){
+		std::pmr::memory_resource* before = std::pmr::get_default_resource();
+		with {
+			Arena<>(ArenaScope::process)(
+				[&](std::pmr::memory_resource* arena){
+					REQUIRE(std::pmr::get_default_resource() == arena);
+				}
+			)
+		};
+
+		REQUIRE(std::pmr::get_default_resource() == before);
+	}
+
+	SECTION("Test other threads may allocate from the process default"){
+		with {
+			Arena<>(ArenaScope::process)(
+				[&](std::pmr::memory_resource* arena){
+					std::vector<std::thread> threads;
+					std::vector<std::size_t> sizes(4);
+					for (std::size_t t = 0; t < sizes.size(); ++t) {
+						threads.emplace_back([&, t]{
+							std::pmr::vector<int> values;
+							for (int i = 0; i < 10000; ++i) {
+								values.push_back(i);
+							}
+							sizes[t] = values.size();
+						});
+					}
+					for (std::thread& thread : threads) {
+						thread.join();
+					}
+					REQUIRE(sizes == std::vector<std::size_t>(4, 10000));
+				}
+			)
+		};
+	}
+}
@@ -1,5 +1,6 @@
 #include <contextual.h>
 #include <stdexcept>
+#include <memory>
 
 using namespace Contextual;
 
@@ -29,20 +30,19 @@ namespace Contextual {
 			}
 		}
 
-		void exit(std::optional<std::exception> e) override {
+		bool exit(std::exception_ptr e) override {
 			if (hide) {
 				std::swap(_password, resources->password);
 			}
 			resources->logged_in = true;
-			if (reraise) {
-				throw e;
-			}
+			return !reraise;
 
 		}
 	public:
 		Resource(IData* resources): IResource<IData>(resources){};
 		Resource(IData &resources, bool hide=true, bool reraise=false): IResource<IData>(resources),
-																  	    hide(hide){
+																  	    hide(hide),
+																  	    reraise(reraise){
 
 		};
 		Resource(IData &&resources): IResource<IData>(&resources){};
@@ -56,6 +56,33 @@ namespace Contextual {
 
 
 
+	// Records what exit was given and suppresses nothing
+	class Observer : public IResource<IData> {
+	private:
+		bool fail_enter = false;
+		void enter() override {
+			if (fail_enter) {
+				throw std::logic_error("enter");
+			}
+		}
+
+		bool exit(std::exception_ptr e) override {
+			++exits;
+			seen = e;
+			return false;
+		}
+	public:
+		int exits = 0;
+		std::exception_ptr seen;
+
+		Observer(IData &resources, bool fail_enter=false): IResource<IData>(resources),
+														  fail_enter(fail_enter){};
+	};
+
+	struct NotAnException {
+		int code;
+	};
+
 	class _With : public With {
 	public:
 		~_With(){
@@ -247,6 +274,82 @@ TEST_CASE("Test exception logic", "[exceptions]"){
 		} catch (std::runtime_error& e) {
 			REQUIRE(e.what() == std::string("TEST"));
 		}
+		REQUIRE(data.password == "password123");
+	}
+
+	SECTION("Test the original exception object is rethrown"){
+		Observer observer(data);
+		const void* thrown = nullptr;
+		const void* caught = nullptr;
+		try{
+			with {
+				observer(
+					[&](auto resource){
+						std::out_of_range error("TEST");
+						thrown = &error;
+						throw error;
+					}
+				)
+			};
+		} catch (std::out_of_range& e) {
+			caught = &e;
+			REQUIRE(e.what() == std::string("TEST"));
+		}
+		REQUIRE(caught != nullptr);
+		REQUIRE(caught != thrown);
+		REQUIRE(observer.exits == 1);
+		REQUIRE(observer.seen != nullptr);
+		try{
+			std::rethrow_exception(observer.seen);
+		} catch (std::out_of_range& e) {
+			REQUIRE(&e == caught);
+		}
+	}
+
+	SECTION("Test exceptions not derived from std::exception reach exit"){
+		Observer observer(data);
+		try{
+			with {
+				observer(
+					[&](auto resource){
+						throw NotAnException{42};
+					}
+				)
+			};
+			REQUIRE(false);
+		} catch (NotAnException& e) {
+			REQUIRE(e.code == 42);
+		}
+		REQUIRE(observer.exits == 1);
+	}
+
+	SECTION("Test exit receives no exception on success"){
+		Observer observer(data);
+		with {
+			observer(
+				[&](auto resource){}
+			)
+		};
+		REQUIRE(observer.exits == 1);
+		REQUIRE(observer.seen == nullptr);
+	}
+
+	SECTION("Test exit is not called when enter fails"){
+		Observer observer(data, true);
+		bool ran = false;
+		try{
+			with {
+				observer(
+					[&](auto resource){
+						ran = true;
+					}
+				)
+			};
+		} catch (std::logic_error& e) {
+			REQUIRE(e.what() == std::string("enter"));
+		}
+		REQUIRE_FALSE(ran);
+		REQUIRE(observer.exits == 0);
 	}
 }
 
@@ -293,6 +396,20 @@ TEST_CASE("Test syntax features", "[syntax]"){
 		};
 	}
 
+	SECTION("Test move-only code block"){
+		// A std::function cannot hold a move-only callable, so this only
+		// compiles if the code block is passed through by its own type.
+		auto counter = std::make_unique<int>(0);
+		with {
+			Resource(data)(
+				[&, owned = std::make_unique<int>(1)](auto resource){
+					*counter += *owned;
+				}
+			)
+		};
+		REQUIRE(*counter == 1);
+	}
+
 	SECTION("Test pointer initialization"){
 		REQUIRE(data.username == "admin");
 		REQUIRE(data.password == "password123");
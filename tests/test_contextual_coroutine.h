@@ -0,0 +1,149 @@
+#if defined(__cpp_impl_coroutine)
+
+#include <contextual.h>
+#include <contextual/coroutine.h>
+#include <vector>
+
+using namespace Contextual;
+
+
+namespace Contextual {
+
+	// Suspends whoever awaits it until it is fired
+	class Trigger {
+	private:
+		std::vector<std::coroutine_handle<>> _waiting;
+		bool _fired = false;
+
+	public:
+		struct Awaiter {
+			Trigger& trigger;
+			bool await_ready() const noexcept { return trigger._fired; }
+			void await_suspend(std::coroutine_handle<> h){ trigger._waiting.push_back(h); }
+			void await_resume() const noexcept {}
+		};
+
+		Awaiter wait(){ return Awaiter{*this}; }
+
+		void fire(){
+			_fired = true;
+			auto waiting = std::move(_waiting);
+			for (auto h : waiting) {
+				h.resume();
+			}
+		}
+	};
+
+	class AsyncStep : public StaticResource<AsyncStep, std::vector<std::string>> {
+	private:
+		friend struct ContextAccess;
+		Trigger* gate;
+		bool suppress;
+
+		Task<> async_enter() {
+			if (gate) {
+				co_await gate->wait();
+			}
+			resources->push_back("enter");
+		}
+
+		Task<bool> async_exit(std::exception_ptr e) {
+			if (!e) {
+				resources->push_back("exit");
+			} else {
+				try{
+					std::rethrow_exception(e);
+				} catch (Cancelled&) {
+					resources->push_back("cancelled exit");
+				} catch (...) {
+					resources->push_back("error exit");
+				}
+			}
+			co_return suppress;
+		}
+	public:
+		AsyncStep(std::vector<std::string> &log, Trigger* gate=nullptr, bool suppress=false):
+			StaticResource<AsyncStep, std::vector<std::string>>(log), gate(gate), suppress(suppress){};
+	};
+
+};
+
+
+TEST_CASE("Test asynchronous contexts", "[coroutine]"){
+	std::vector<std::string> log;
+
+	SECTION("Test the value of the block is returned after exit"){
+		int value = sync_wait(co_with(AsyncStep(log),
+			[&](auto resource) -> Task<int> {
+				resource->push_back("block");
+				co_return 42;
+			}
+		));
+		REQUIRE(value == 42);
+		REQUIRE(log == std::vector<std::string>{"enter", "block", "exit"});
+	}
+
+	SECTION("Test exceptions reach async_exit"){
+		REQUIRE_THROWS_AS(sync_wait(co_with(AsyncStep(log),
+			[&](auto resource) -> Task<> {
+				throw std::runtime_error("block");
+				co_return;
+			}
+		)), std::runtime_error);
+		REQUIRE(log == std::vector<std::string>{"enter", "error exit"});
+
+		int value = sync_wait(co_with(AsyncStep(log, nullptr, true),
+			[&](auto resource) -> Task<int> {
+				throw std::runtime_error("block");
+				co_return 1;
+			}
+		));
+		REQUIRE(value == 0);
+	}
+
+	SECTION("Test contexts suspend in enter and in the block"){
+		Trigger entered;
+		Trigger resumed;
+		auto outer = [&]() -> Task<int> {
+			int value = co_await co_with(AsyncStep(log, &entered),
+				[&](auto resource) -> Task<int> {
+					resource->push_back("block");
+					co_await resumed.wait();
+					co_return 7;
+				}
+			);
+			co_return value + 1;
+		};
+
+		Task<int> task = outer();
+		task.start();
+		REQUIRE_FALSE(task.done());
+		REQUIRE(log.empty());
+
+		entered.fire();
+		REQUIRE_FALSE(task.done());
+		REQUIRE(log == std::vector<std::string>{"enter", "block"});
+
+		resumed.fire();
+		REQUIRE(task.done());
+		REQUIRE(task.result() == 8);
+		REQUIRE(log == std::vector<std::string>{"enter", "block", "exit"});
+	}
+
+	SECTION("Test exit runs when the context is cancelled"){
+		Trigger never;
+		{
+			Task<> task = co_with(AsyncStep(log),
+				[&](auto resource) -> Task<> {
+					co_await never.wait();
+					resource->push_back("unreachable");
+				}
+			);
+			task.start();
+			REQUIRE(log == std::vector<std::string>{"enter"});
+		}
+		REQUIRE(log == std::vector<std::string>{"enter", "cancelled exit"});
+	}
+}
+
+#endif
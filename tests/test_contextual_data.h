@@ -0,0 +1,83 @@
+#include <contextual.h>
+#include <type_traits>
+
+using namespace Contextual;
+
+
+namespace Contextual {
+
+	struct LockData {
+		bool held = false;
+	};
+
+	struct FileData {
+		std::string path;
+		int opened = 0;
+	};
+
+	class Lock : public IResource<LockData> {
+	private:
+		void enter() override {
+			resources->held = true;
+		}
+
+		bool exit(std::exception_ptr e) override {
+			resources->held = false;
+			return true;
+		}
+	public:
+		Lock(LockData &resources): IResource<LockData>(resources){};
+	};
+
+	class File : public StaticResource<File, FileData> {
+	private:
+		friend struct ContextAccess;
+		void enter() {
+			++resources->opened;
+		}
+
+		bool exit(std::exception_ptr e) {
+			--resources->opened;
+			return true;
+		}
+	public:
+		File(FileData &resources): StaticResource<File, FileData>(resources){};
+	};
+
+};
+
+
+TEST_CASE("Test per-resource data types", "[data]"){
+	LockData lock;
+	FileData file{"log.txt"};
+
+	SECTION("Test the data type of each resource manager"){
+		REQUIRE(std::is_same<resource_data_t<Lock>, LockData>::value);
+		REQUIRE(std::is_same<resource_data_t<File>, FileData>::value);
+		REQUIRE(std::is_same<resource_data_t<Resource>, IData>::value);
+	}
+
+	SECTION("Test each code block receives its own data"){
+		with {
+			Lock(lock)(
+				[&](auto resource){
+					static_assert(std::is_same<decltype(resource), LockData*>::value, "");
+					REQUIRE(resource->held);
+
+					with {
+						File(file)(
+							[&](auto resource){
+								static_assert(std::is_same<decltype(resource), FileData*>::value, "");
+								REQUIRE(resource->path == "log.txt");
+								REQUIRE(resource->opened == 1);
+							}
+						)
+					};
+				}
+			)
+		};
+
+		REQUIRE_FALSE(lock.held);
+		REQUIRE(file.opened == 0);
+	}
+}
@@ -0,0 +1,128 @@
+#include <contextual.h>
+#include <contextual/exit_stack.h>
+#include <contextual/allocation.h>
+#include <vector>
+
+using namespace Contextual;
+
+
+TEST_CASE("Test dynamic numbers of resources", "[exit-stack]"){
+	std::vector<std::string> log;
+	IData data{"admin", "password123"};
+
+	SECTION("Test resources are unwound in reverse"){
+		with {
+			ExitStack<>()(
+				[&](auto stack){
+					for (std::string name : {"a", "b", "c"}) {
+						stack->enter_context(Step(log, name));
+					}
+					REQUIRE(stack->size() == 3);
+					log.push_back("block");
+				}
+			)
+		};
+		REQUIRE(log == std::vector<std::string>{"enter a", "enter b", "enter c", "block",
+												 "exit c", "exit b", "exit a"});
+	}
+
+	SECTION("Test the data of each resource is returned"){
+		with {
+			ExitStack<>()(
+				[&](auto stack){
+					IData* masked = stack->enter_context(Resource(data));
+					REQUIRE(masked == &data);
+					REQUIRE(data.password == "xxxxxxxxx");
+
+					Observer observer(data);
+					stack->enter_context(observer);
+					IData* owned = stack->template emplace_context<Session>("guest", "secret");
+					REQUIRE(owned->username == "guest");
+					REQUIRE(owned->password == "xxxxxxxxx");
+				}
+			)
+		};
+		REQUIRE(data.password == "password123");
+	}
+
+	SECTION("Test callbacks and exit functions"){
+		std::exception_ptr seen;
+		with {
+			ExitStack<>()(
+				[&](auto stack){
+					stack->callback([&]{ log.push_back("callback"); });
+					stack->push([&](std::exception_ptr e){
+						seen = e;
+						log.push_back("push");
+						return true;
+					});
+					stack->enter_context(Step(log, "a"));
+					throw std::runtime_error("block");
+				}
+			)
+		};
+		REQUIRE(log == std::vector<std::string>{"enter a", "error exit a", "push", "callback"});
+		REQUIRE(seen != nullptr);
+	}
+
+	SECTION("Test exceptions propagate unless suppressed"){
+		REQUIRE_THROWS_AS(with {
+			ExitStack<>()(
+				[&](auto stack){
+					stack->enter_context(Step(log, "a"));
+					throw std::runtime_error("block");
+				}
+			)
+		}, std::runtime_error);
+		REQUIRE(log == std::vector<std::string>{"enter a", "error exit a"});
+	}
+
+	SECTION("Test a failed enter is not pushed"){
+		REQUIRE_THROWS_AS(with {
+			ExitStack<>()(
+				[&](auto stack){
+					stack->enter_context(Step(log, "a"));
+					stack->enter_context(Step(log, "b", true));
+				}
+			)
+		}, std::runtime_error);
+		REQUIRE(log == std::vector<std::string>{"enter a", "error exit a"});
+	}
+
+	SECTION("Test more entries than fit inline"){
+		with {
+			ExitStack<2, 64>()(
+				[&](auto stack){
+					for (int i = 0; i < 20; ++i) {
+						stack->enter_context(Step(log, std::to_string(i)));
+					}
+					REQUIRE(stack->size() == 20);
+				}
+			)
+		};
+		REQUIRE(log.size() == 40);
+		REQUIRE(log.back() == "exit 0");
+		REQUIRE(log[20] == "exit 19");
+	}
+
+	SECTION("Test spilled entries grow geometrically"){
+		int count = 0;
+		Counter counter(count);
+		AllocationCounts counts;
+		with {
+			CountAllocations(counts)([&](AllocationCounts*){
+				with {
+					ExitStack<2, 64>()(
+						[&](auto stack){
+							for (int i = 0; i < 1000; ++i) {
+								stack->enter_context(counter);
+							}
+						}
+					)
+				};
+			})
+		};
+		REQUIRE(count == 0);
+		REQUIRE(counts.allocations < 20);
+	}
+}
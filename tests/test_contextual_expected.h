@@ -0,0 +1,91 @@
+#include <contextual.h>
+
+using namespace Contextual;
+
+
+namespace Contextual {
+
+	struct Connection {
+		bool open = false;
+		std::error_code last_error;
+	};
+
+	class Connect : public StaticResource<Connect, Connection> {
+	private:
+		friend struct ContextAccess;
+		bool handle_errors = false;
+		void enter() {
+			resources->open = true;
+		}
+
+		bool exit(const std::error_code& e) {
+			resources->open = false;
+			resources->last_error = e;
+			return handle_errors;
+		}
+	public:
+		Connect(Connection &resources, bool handle_errors=false): StaticResource<Connect, Connection>(resources),
+																   handle_errors(handle_errors){};
+	};
+
+};
+
+
+TEST_CASE("Test error value contexts", "[expected]"){
+	Connection connection;
+
+	SECTION("Test a successful block returns its value"){
+		auto result = with_expected(Connect(connection),
+			[&](auto resource) noexcept -> Expected<int> {
+				REQUIRE(resource->open);
+				return 42;
+			}
+		);
+		REQUIRE(result.has_value());
+		REQUIRE(*result == 42);
+		REQUIRE_FALSE(connection.open);
+		REQUIRE_FALSE(connection.last_error);
+	}
+
+	SECTION("Test exit receives the error code"){
+		auto result = with_expected(Connect(connection),
+			[&](auto resource) noexcept -> Expected<void> {
+				return unexpected(std::make_error_code(std::errc::connection_refused));
+			}
+		);
+		REQUIRE_FALSE(result);
+		REQUIRE(result.error() == std::errc::connection_refused);
+		REQUIRE(connection.last_error == std::errc::connection_refused);
+		REQUIRE_FALSE(connection.open);
+	}
+
+	SECTION("Test exit can handle the error"){
+		auto result = with_expected(Connect(connection, true),
+			[&](auto resource) -> Expected<int> {
+				return unexpected(std::make_error_code(std::errc::timed_out));
+			}
+		);
+		REQUIRE(result.has_value());
+		REQUIRE(*result == 0);
+		REQUIRE(connection.last_error == std::errc::timed_out);
+	}
+
+	SECTION("Test exceptions are translated at the boundary"){
+		auto result = with_expected(Connect(connection),
+			[&](auto resource) -> Expected<int> {
+				throw std::system_error(std::make_error_code(std::errc::broken_pipe));
+			}
+		);
+		REQUIRE_FALSE(result);
+		REQUIRE(result.error() == std::errc::broken_pipe);
+		REQUIRE(connection.last_error == std::errc::broken_pipe);
+
+		auto other = with_expected(Connect(connection),
+			[&](auto resource) -> Expected<int> {
+				throw 1;
+			}
+		);
+		REQUIRE(other.error() == std::errc::state_not_recoverable);
+		REQUIRE_FALSE(connection.open);
+	}
+}
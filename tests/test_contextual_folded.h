@@ -0,0 +1,131 @@
+#include <contextual/folded.h>
+#include <functional>
+#include <sstream>
+#include <thread>
+
+using namespace Contextual;
+
+
+namespace Contextual {
+
+	// A resource manager whose name is chosen when it is made
+	class Named : public StaticResource<Named, int> {
+	private:
+		friend struct ContextAccess;
+		const char* _name;
+
+		void enter() noexcept {}
+
+		bool exit(std::exception_ptr e) noexcept {
+			return false;
+		}
+	public:
+		Named(int& resources, const char* name): StaticResource<Named, int>(resources), _name(name){};
+
+		const char* context_name() const { return _name; }
+	};
+
+};
+
+namespace {
+
+	FoldedStack folded(const std::string& path){
+		for (FoldedStack& stack : FoldedStacks::global().snapshot()) {
+			if (stack.path == path) {
+				return stack;
+			}
+		}
+		return FoldedStack();
+	}
+
+};
+
+TEST_CASE("Test folded stacks of nested contexts", "[folded]"){
+	FoldedStacks& stacks = FoldedStacks::global();
+	stacks.reset();
+	int data = 0;
+
+	SECTION("Test inclusive and exclusive time per path"){
+		for (int i = 0; i < 3; ++i) {
+			with {
+				Named(data, "test.outer")([&](int*){
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+					with {
+						Named(data, "test.inner")([&](int*){
+							std::this_thread::sleep_for(std::chrono::milliseconds(2));
+						})
+					};
+				})
+			};
+		}
+
+		FoldedStack outer = folded("test.outer");
+		FoldedStack inner = folded("test.outer;test.inner");
+		REQUIRE(outer.count == 3);
+		REQUIRE(inner.count == 3);
+		REQUIRE(inner.inclusive == inner.exclusive);
+		REQUIRE(inner.inclusive >= 6000000);
+		REQUIRE(outer.inclusive >= inner.inclusive + 3000000);
+		REQUIRE(outer.exclusive == outer.inclusive - inner.inclusive);
+	}
+
+	SECTION("Test the same context is a different path elsewhere"){
+		with { Named(data, "test.inner")() };
+		with {
+			Named(data, "test.outer")([&](int*){ with { Named(data, "test.inner")() }; })
+		};
+
+		REQUIRE(folded("test.inner").count == 1);
+		REQUIRE(folded("test.outer;test.inner").count == 1);
+	}
+
+	SECTION("Test deep recursion is bounded"){
+		std::function<void(std::size_t)> recurse = [&](std::size_t depth){
+			if (depth == 0) {
+				return;
+			}
+			with { Named(data, "test.recursive")([&](int*){ recurse(depth - 1); }) };
+		};
+		recurse(FoldedStacks::max_depth + 10);
+		with { Named(data, "test.after")() };
+
+		std::size_t deepest = 0;
+		for (const FoldedStack& stack : stacks.snapshot()) {
+			deepest = std::max<std::size_t>(deepest, std::count(stack.path.begin(), stack.path.end(), ';') + 1);
+		}
+		REQUIRE(deepest == FoldedStacks::max_depth);
+		REQUIRE(folded("test.after").count == 1);
+	}
+
+	SECTION("Test names built at run time are kept apart and outlive their contexts"){
+		// Each name is likely at the same address as the one before
+		for (int i = 0; i < 4; ++i) {
+			with {
+				Labelled(data, "test.folded." + std::string(40, 'a' + i % 2))([&](int*){
+					with { Labelled(data, "test.folded.inner")() };
+				})
+			};
+		}
+
+		std::string a = "test.folded." + std::string(40, 'a');
+		std::string b = "test.folded." + std::string(40, 'b');
+		REQUIRE(folded(a).count == 2);
+		REQUIRE(folded(b).count == 2);
+		REQUIRE(folded(a + ";test.folded.inner").count == 2);
+		REQUIRE(folded(b + ";test.folded.inner").count == 2);
+	}
+
+	SECTION("Test the folded format"){
+		std::thread worker([&]{
+			with {
+				Named(data, "test.outer")([&](int*){ with { Named(data, "test.inner")() }; })
+			};
+		});
+		worker.join();
+
+		std::ostringstream out;
+		out << '\n';
+		stacks.dump(out);
+		REQUIRE(out.str().find("\ntest.outer;test.inner ") != std::string::npos);
+	}
+}
@@ -0,0 +1,120 @@
+#if defined(__cpp_impl_coroutine)
+
+#include <contextual.h>
+#include <contextual/generator.h>
+#include <vector>
+
+using namespace Contextual;
+
+
+namespace Contextual {
+
+	GeneratorResource<IData> masked(IData& data, std::vector<std::string>& log, bool handle=false){
+		std::string password = "xxxxxxxxx";
+		std::swap(password, data.password);
+		log.push_back("setup");
+		try{
+			co_yield data;
+		} catch (std::runtime_error& e) {
+			log.push_back(std::string("caught ") + e.what());
+			if (!handle) {
+				std::swap(password, data.password);
+				throw;
+			}
+		}
+		std::swap(password, data.password);
+		log.push_back("teardown");
+	}
+
+	GeneratorResource<IData> replacing(IData& data){
+		try{
+			co_yield data;
+		} catch (...) {
+			throw std::logic_error("replaced");
+		}
+	}
+
+	GeneratorResource<IData> failing(IData& data){
+		throw std::out_of_range("setup");
+		co_yield data;
+	}
+
+};
+
+
+TEST_CASE("Test resource managers written as generators", "[generator]"){
+	std::vector<std::string> log;
+	IData data{"admin", "password123"};
+
+	SECTION("Test setup and teardown around the block"){
+		with {
+			masked(data, log)(
+				[&](auto resource){
+					REQUIRE(resource == &data);
+					REQUIRE(resource->password == "xxxxxxxxx");
+					log.push_back("block");
+				}
+			)
+		};
+		REQUIRE(data.password == "password123");
+		REQUIRE(log == std::vector<std::string>{"setup", "block", "teardown"});
+	}
+
+	SECTION("Test exceptions are rethrown at the yield"){
+		REQUIRE_THROWS_WITH(with {
+			masked(data, log)(
+				[&](auto resource){
+					throw std::runtime_error("block");
+				}
+			)
+		}, "block");
+		REQUIRE(data.password == "password123");
+		REQUIRE(log == std::vector<std::string>{"setup", "caught block"});
+	}
+
+	SECTION("Test a generator that handles the exception suppresses it"){
+		with {
+			masked(data, log, true)(
+				[&](auto resource){
+					throw std::runtime_error("block");
+				}
+			)
+		};
+		REQUIRE(log == std::vector<std::string>{"setup", "caught block", "teardown"});
+	}
+
+	SECTION("Test a generator can replace the exception"){
+		REQUIRE_THROWS_AS(with {
+			replacing(data)(
+				[&](auto resource){
+					throw std::runtime_error("block");
+				}
+			)
+		}, std::logic_error);
+	}
+
+	SECTION("Test exceptions from the setup"){
+		bool ran = false;
+		REQUIRE_THROWS_AS(with {
+			failing(data)(
+				[&](auto resource){
+					ran = true;
+				}
+			)
+		}, std::out_of_range);
+		REQUIRE_FALSE(ran);
+	}
+
+	SECTION("Test frames are recycled"){
+		for (int i = 0; i < 2; ++i) {
+			with { masked(data, log)() };
+		}
+		std::size_t allocations = FramePool::local().allocations();
+		for (int i = 0; i < 100; ++i) {
+			with { masked(data, log)() };
+		}
+		REQUIRE(FramePool::local().allocations() == allocations);
+	}
+}
+
+#endif
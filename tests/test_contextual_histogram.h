@@ -0,0 +1,167 @@
+#include <contextual/histogram.h>
+#include <chrono>
+#include <string>
+#include <thread>
+
+using namespace Contextual;
+
+
+namespace Contextual {
+
+	// A resource manager with a name, that can be made to fail or to be slow
+	class Timed : public StaticResource<Timed, int> {
+	private:
+		friend struct ContextAccess;
+		bool _fail_enter;
+		std::chrono::microseconds _exit_time;
+
+		void enter(){
+			if (_fail_enter) {
+				throw std::runtime_error("enter");
+			}
+		}
+
+		bool exit(std::exception_ptr e){
+			std::this_thread::sleep_for(_exit_time);
+			return true;
+		}
+	public:
+		Timed(int& resources, bool fail_enter=false, std::chrono::microseconds exit_time=std::chrono::microseconds(0)):
+			StaticResource<Timed, int>(resources), _fail_enter(fail_enter), _exit_time(exit_time){};
+
+		const char* context_name() const { return "test.timed"; }
+	};
+
+	// A resource manager named at run time, whose name is gone with it
+	class Labelled : public StaticResource<Labelled, int> {
+	private:
+		friend struct ContextAccess;
+		std::string _name;
+
+		void enter() noexcept {}
+
+		bool exit(std::exception_ptr e) noexcept {
+			return false;
+		}
+	public:
+		Labelled(int& resources, std::string name): StaticResource<Labelled, int>(resources), _name(std::move(name)){};
+
+		const char* context_name() const { return _name.c_str(); }
+	};
+
+};
+
+namespace {
+
+	LatencySnapshot latency_of(const std::string& name){
+		for (LatencySnapshot& snapshot : LatencyHistograms::global().snapshot()) {
+			if (snapshot.name == name) {
+				return snapshot;
+			}
+		}
+		return LatencySnapshot();
+	}
+
+};
+
+TEST_CASE("Test log-linear histograms", "[histogram]"){
+	SECTION("Test every bucket holds its highest value"){
+		for (std::size_t i = 0; i < LatencyHistogram::bucket_count; ++i) {
+			REQUIRE(LatencyHistogram::bucket(LatencyHistogram::highest(i)) == i);
+		}
+	}
+
+	SECTION("Test percentiles are within the precision"){
+		LatencyHistogram histogram;
+		for (int i = 1; i <= 100000; ++i) {
+			histogram.record(std::chrono::nanoseconds(i));
+		}
+
+		REQUIRE(histogram.count() == 100000);
+		REQUIRE(histogram.percentile(0).count() == 1);
+		REQUIRE(std::abs(histogram.percentile(50).count() - 50000) <= 50000 * 0.032);
+		REQUIRE(std::abs(histogram.percentile(99).count() - 99000) <= 99000 * 0.032);
+		REQUIRE(histogram.max().count() >= 100000);
+		REQUIRE(histogram.max().count() <= 100000 * 1.032);
+	}
+}
+
+TEST_CASE("Test latency histograms of contexts", "[histogram]"){
+	LatencyHistograms& histograms = LatencyHistograms::global();
+	histograms.reset();
+	int data = 0;
+
+	SECTION("Test each phase is recorded"){
+		with {
+			Timed(data, false, std::chrono::microseconds(2000))(
+				[&](int*){ std::this_thread::sleep_for(std::chrono::milliseconds(1)); }
+			)
+		};
+
+		LatencySnapshot snapshot = latency_of("test.timed");
+		REQUIRE(snapshot.count() == 1);
+		REQUIRE(snapshot.block.count() == 1);
+		REQUIRE(snapshot.block.percentile(50) >= std::chrono::milliseconds(1));
+		REQUIRE(snapshot.exit.percentile(50) >= std::chrono::milliseconds(2));
+		REQUIRE(snapshot.exceptions == 0);
+	}
+
+	SECTION("Test exceptions and failed enters are counted"){
+		with {
+			Timed(data)(
+				[&](int*){ throw std::runtime_error("block"); }
+			)
+		};
+		REQUIRE_THROWS_AS(with { Timed(data, true)() }, std::runtime_error);
+
+		LatencySnapshot snapshot = latency_of("test.timed");
+		REQUIRE(snapshot.count() == 2);
+		REQUIRE(snapshot.exceptions == 1);
+		REQUIRE(snapshot.enter_failures == 1);
+		REQUIRE(snapshot.block.count() == 1);
+	}
+
+	SECTION("Test contexts are named by type"){
+		int count = 0;
+		with { Counter(count)() };
+
+		REQUIRE(latency_of("Contextual::Counter").count() == 1);
+	}
+
+	SECTION("Test names built at run time are told apart by their text"){
+		// Each name is likely at the same address as the one before
+		for (int i = 0; i < 6; ++i) {
+			with { Labelled(data, "test.labelled." + std::to_string(i % 2))() };
+		}
+
+		REQUIRE(latency_of("test.labelled.0").count() == 3);
+		REQUIRE(latency_of("test.labelled.1").count() == 3);
+	}
+
+	SECTION("Test a thread keeps histograms for max_names names at most"){
+		std::thread worker([&]{
+			for (std::size_t i = 0; i < LatencyHistograms::max_names + 10; ++i) {
+				with { Labelled(data, "test.many." + std::to_string(i))() };
+			}
+		});
+		worker.join();
+
+		REQUIRE(latency_of("test.many.0").count() == 1);
+		REQUIRE(latency_of(other_contexts).count() == 10);
+	}
+
+	SECTION("Test threads that have exited are kept"){
+		std::thread worker([&]{
+			for (int i = 0; i < 10; ++i) {
+				with { Timed(data)() };
+			}
+		});
+		worker.join();
+		with { Timed(data)() };
+
+		REQUIRE(latency_of("test.timed").count() == 11);
+
+		histograms.reset();
+		REQUIRE(latency_of("test.timed").count() == 0);
+	}
+}
@@ -0,0 +1,132 @@
+#include <contextual/instrument.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace Contextual;
+
+
+namespace Contextual {
+
+	// Counts its contexts by their instrumentation policy
+	template <Instrumentation policy>
+	class Policed : public StaticResource<Policed<policy>, int> {
+	private:
+		friend struct ContextAccess;
+		void enter() noexcept {}
+
+		bool exit(std::exception_ptr e) noexcept {
+			return false;
+		}
+	public:
+		static constexpr Instrumentation instrumentation = policy;
+
+		Policed(int& resources): StaticResource<Policed<policy>, int>(resources){};
+
+		const char* context_name() const {
+			return policy == Instrumentation::off ? "test.off" :
+				   policy == Instrumentation::sampled ? "test.sampled" : "test.full";
+		}
+	};
+
+	// Keeps the names of the contexts it sees on this thread
+	class Recorder : public ContextObserver {
+	public:
+		std::vector<std::string> begun;
+		std::vector<std::string> ended;
+		std::thread::id thread = std::this_thread::get_id();
+
+		void begin(const char* name) override {
+			if (std::this_thread::get_id() == thread) {
+				begun.push_back(name);
+			}
+		}
+
+		void end(const ContextSample& sample) override {
+			if (std::this_thread::get_id() == thread) {
+				ended.push_back(sample.name);
+			}
+		}
+	};
+
+};
+
+TEST_CASE("Test instrumentation policies", "[instrument]"){
+	Recorder recorder;
+	REQUIRE(add_observer(recorder));
+	int data = 0;
+
+	SECTION("Test the default policy"){
+		REQUIRE(default_instrumentation == Instrumentation::full);
+		REQUIRE(instrumentation_of<Timed>::value == Instrumentation::full);
+		REQUIRE(instrumentation_of<Policed<Instrumentation::off>>::value == Instrumentation::off);
+	}
+
+	SECTION("Test the off policy is not observed"){
+		with { Policed<Instrumentation::off>(data)() };
+		with { Policed<Instrumentation::full>(data)() };
+
+		REQUIRE(recorder.ended == std::vector<std::string>{"test.full"});
+	}
+
+	SECTION("Test 1 in n outermost contexts are sampled"){
+		set_sample_every(4);
+		for (int i = 0; i < 8; ++i) {
+			with { Policed<Instrumentation::sampled>(data)() };
+		}
+		set_sample_every(CONTEXTUAL_SAMPLE_EVERY);
+
+		REQUIRE(recorder.begun.size() == 2);
+		REQUIRE(recorder.ended.size() == 2);
+	}
+
+	SECTION("Test every way of running a context is observed"){
+		REQUIRE(with_result(Policed<Instrumentation::full>(data), [&](int*){ return 1; }) == 1);
+		Connection connection;
+		with_expected(Connect(connection), [&](Connection*) noexcept -> Expected<int> { return 1; });
+		with {
+			with_all(Policed<Instrumentation::full>(data), Policed<Instrumentation::off>(data))()
+		};
+#if defined(__cpp_impl_coroutine)
+		std::vector<std::string> log;
+		sync_wait(co_with(AsyncStep(log), [&](auto) -> Task<int> { co_return 1; }));
+#endif
+
+		std::vector<std::string> ended;
+		for (const std::string& name : recorder.ended) {
+			ended.push_back(readable_name(name.c_str()));
+		}
+		REQUIRE(ended.size() >= 4);
+		REQUIRE(ended[0] == "test.full");
+		REQUIRE(ended[1] == "Contextual::Connect");
+		// The resource managers of a group are nested in it
+		REQUIRE(ended[2] == "test.full");
+		REQUIRE(ended[3].rfind("Contextual::All<", 0) == 0);
+		REQUIRE(readable_name(recorder.begun[2].c_str()).rfind("Contextual::All<", 0) == 0);
+		REQUIRE(recorder.begun[3] == "test.full");
+#if defined(__cpp_impl_coroutine)
+		REQUIRE(ended.size() == 5);
+		REQUIRE(ended[4] == "Contextual::AsyncStep");
+#else
+		REQUIRE(ended.size() == 4);
+#endif
+	}
+
+	SECTION("Test nested contexts follow the outermost"){
+		set_sample_every(2);
+		for (int i = 0; i < 4; ++i) {
+			with {
+				Policed<Instrumentation::sampled>(data)([&](int*){
+					with { Policed<Instrumentation::sampled>(data)() };
+				})
+			};
+		}
+		set_sample_every(0);
+		with { Policed<Instrumentation::sampled>(data)() };
+		set_sample_every(CONTEXTUAL_SAMPLE_EVERY);
+
+		REQUIRE(recorder.ended.size() == 4);
+	}
+
+	remove_observer(recorder);
+}
@@ -0,0 +1,194 @@
+#include <contextual/linger.h>
+#include <thread>
+
+using namespace Contextual;
+
+
+namespace Contextual {
+
+	struct Attachments {
+		int enters = 0;
+		int exits = 0;
+		bool exception = false;
+	};
+
+	// A resource manager whose enter and exit would be expensive
+	class Attach : public StaticResource<Attach, Attachments> {
+	private:
+		friend struct ContextAccess;
+
+		void enter(){
+			++resources->enters;
+		}
+
+		bool exit(std::exception_ptr e){
+			++resources->exits;
+			resources->exception = e != nullptr;
+			return false;
+		}
+	public:
+		Attach(Attachments& attachments): StaticResource<Attach, Attachments>(attachments){};
+	};
+
+	// Another type of resource manager, lingering under a policy of its own
+	class AttachOther : public Attach {
+	public:
+		using Attach::Attach;
+	};
+
+};
+
+namespace {
+
+	void attach(Attachments& attachments, const std::string& key, LingerPolicy policy = LingerPolicy()){
+		with {
+			linger(key, [&]{ return Attach(attachments); }, policy)([&](Attachments* a){
+				REQUIRE(a == &attachments);
+			})
+		};
+	}
+
+	void attach_other(Attachments& attachments, const std::string& key, LingerPolicy policy){
+		with {
+			linger(key, [&]{ return AttachOther(attachments); }, policy)([&](Attachments*){})
+		};
+	}
+
+	LingerPolicy linger_policy(std::chrono::nanoseconds time, std::size_t uses=0, std::size_t capacity=16){
+		LingerPolicy policy;
+		policy.time = time;
+		policy.uses = uses;
+		policy.capacity = capacity;
+		return policy;
+	}
+
+};
+
+TEST_CASE("Test lingering resources", "[linger]"){
+	flush_lingering();
+	Attachments attachments;
+	LingerPolicy long_time = linger_policy(std::chrono::seconds(10));
+
+	SECTION("Test consecutive contexts with the same key enter once"){
+		for (int i = 0; i < 3; ++i) {
+			attach(attachments, "segment", long_time);
+		}
+		REQUIRE(attachments.enters == 1);
+		REQUIRE(attachments.exits == 0);
+		REQUIRE(lingering_count() == 1);
+		flush_lingering();
+		REQUIRE(attachments.exits == 1);
+		REQUIRE(lingering_count() == 0);
+	}
+
+	SECTION("Test different keys linger separately"){
+		attach(attachments, "a", long_time);
+		attach(attachments, "b", long_time);
+		attach(attachments, "a", long_time);
+		REQUIRE(attachments.enters == 2);
+		REQUIRE(lingering_count() == 2);
+		flush_lingering();
+		REQUIRE(attachments.exits == 2);
+	}
+
+	SECTION("Test a resource is released once its time is over"){
+		LingerPolicy short_time = linger_policy(std::chrono::milliseconds(1));
+		attach(attachments, "a", short_time);
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		// Noticed by the next lingering context on the thread
+		attach(attachments, "b", short_time);
+		REQUIRE(attachments.exits == 1);
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		attach(attachments, "b", short_time);
+		REQUIRE(attachments.enters == 3);
+		flush_lingering();
+		REQUIRE(attachments.exits == 3);
+	}
+
+	SECTION("Test a resource is released after its number of uses"){
+		LingerPolicy twice = linger_policy(std::chrono::seconds(10), 2);
+		attach(attachments, "a", twice);
+		attach(attachments, "a", twice);
+		REQUIRE(attachments.enters == 1);
+		REQUIRE(attachments.exits == 1);
+		REQUIRE(lingering_count() == 0);
+		attach(attachments, "a", twice);
+		REQUIRE(attachments.enters == 2);
+		flush_lingering();
+	}
+
+	SECTION("Test the least recently used resource is evicted"){
+		LingerPolicy two = linger_policy(std::chrono::seconds(10), 0, 2);
+		attach(attachments, "a", two);
+		attach(attachments, "b", two);
+		attach(attachments, "a", two);
+		attach(attachments, "c", two);
+		REQUIRE(attachments.exits == 1);
+		// b was evicted, a still lingers
+		attach(attachments, "a", two);
+		REQUIRE(attachments.enters == 3);
+		attach(attachments, "b", two);
+		REQUIRE(attachments.enters == 4);
+		flush_lingering();
+		REQUIRE(attachments.exits == 4);
+	}
+
+	SECTION("Test a capacity only evicts resources of its own type"){
+		attach(attachments, "a", long_time);
+		attach(attachments, "b", long_time);
+		Attachments others;
+		attach_other(others, "c", linger_policy(std::chrono::seconds(10), 0, 1));
+		attach_other(others, "d", linger_policy(std::chrono::seconds(10), 0, 1));
+		REQUIRE(others.exits == 1);
+		// Not lingering at all
+		attach_other(others, "e", linger_policy(std::chrono::seconds(10), 0, 0));
+		REQUIRE(others.exits == 2);
+		REQUIRE(attachments.exits == 0);
+		REQUIRE(lingering_count() == 3);
+		flush_lingering();
+		REQUIRE(attachments.exits == 2);
+		REQUIRE(others.exits == 3);
+	}
+
+	SECTION("Test a block that throws releases its resource with the exception"){
+		attach(attachments, "a", long_time);
+		REQUIRE_THROWS_AS(
+			with {
+				linger("a", [&]{ return Attach(attachments); }, long_time)([&](Attachments*){
+					throw std::runtime_error("failed");
+				})
+			},
+			std::runtime_error
+		);
+		REQUIRE(attachments.exits == 1);
+		REQUIRE(attachments.exception);
+		REQUIRE(lingering_count() == 0);
+		attach(attachments, "a", long_time);
+		REQUIRE(attachments.enters == 2);
+		flush_lingering();
+	}
+
+	SECTION("Test nested contexts with the same key do not share"){
+		with {
+			linger("a", [&]{ return Attach(attachments); }, long_time)([&](Attachments*){
+				attach(attachments, "a", long_time);
+				REQUIRE(attachments.enters == 2);
+			})
+		};
+		REQUIRE(lingering_count() == 2);
+		attach(attachments, "a", long_time);
+		REQUIRE(attachments.enters == 2);
+		flush_lingering();
+		REQUIRE(attachments.exits == 2);
+	}
+
+	SECTION("Test resources are released when their thread exits"){
+		std::thread([&]{
+			attach(attachments, "a", long_time);
+			attach(attachments, "a", long_time);
+		}).join();
+		REQUIRE(attachments.enters == 1);
+		REQUIRE(attachments.exits == 1);
+		REQUIRE(lingering_count() == 0);
+	}
+}
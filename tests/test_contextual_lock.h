@@ -0,0 +1,349 @@
+#include <contextual/lock.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <type_traits>
+
+using namespace Contextual;
+
+
+namespace Contextual {
+
+	// A user-defined lockable
+	class SpinLock {
+	private:
+		std::atomic_flag _flag = ATOMIC_FLAG_INIT;
+	public:
+		void lock(){ while (_flag.test_and_set(std::memory_order_acquire)) {} }
+		bool try_lock(){ return !_flag.test_and_set(std::memory_order_acquire); }
+		void unlock(){ _flag.clear(std::memory_order_release); }
+	};
+
+};
+
+
+TEST_CASE("Test lock resources", "[lock]"){
+	SECTION("Test the guarded value is only handed out locked"){
+		Guarded<int> counter(41);
+		with {
+			locked(counter)(
+				[&](int* value){
+					++*value;
+				}
+			)
+		};
+
+		with {
+			locked(counter)(
+				[&](int* value){
+					REQUIRE(*value == 42);
+				}
+			)
+		};
+	}
+
+	SECTION("Test the mutex is released when the block throws"){
+		std::mutex mutex;
+		auto throwing = [&]{
+			with {
+				locked(mutex)(
+					[&](std::mutex*){ throw std::runtime_error("lock"); }
+				)
+			};
+		};
+		REQUIRE_THROWS_AS(throwing(), std::runtime_error);
+		REQUIRE(mutex.try_lock());
+		mutex.unlock();
+	}
+
+	SECTION("Test shared locks"){
+		Guarded<int, std::shared_mutex> value(7);
+		with {
+			locked_shared(value)(
+				[&](auto outer){
+					REQUIRE(std::is_same<decltype(outer), const int*>::value);
+					with {
+						locked_shared(value)(
+							[&](const int* inner){
+								REQUIRE(inner == outer);
+							}
+						)
+					};
+				}
+			)
+		};
+	}
+
+	SECTION("Test user lockables"){
+		SpinLock spin;
+		with {
+			locked(spin)(
+				[&](SpinLock* lock){
+					REQUIRE_FALSE(lock->try_lock());
+				}
+			)
+		};
+		REQUIRE(spin.try_lock());
+	}
+
+	SECTION("Test timed locks time out"){
+		std::timed_mutex mutex;
+		std::mutex ready_lock;
+		std::condition_variable ready_changed;
+		bool held = false;
+		bool done = false;
+		std::thread holder([&]{
+			std::unique_lock<std::timed_mutex> hold(mutex);
+			std::unique_lock<std::mutex> signal(ready_lock);
+			held = true;
+			ready_changed.notify_all();
+			ready_changed.wait(signal, [&]{ return done; });
+		});
+		{
+			std::unique_lock<std::mutex> signal(ready_lock);
+			ready_changed.wait(signal, [&]{ return held; });
+		}
+
+		bool entered = false;
+		auto waiting = [&]{
+			with {
+				locked_for(mutex, std::chrono::milliseconds(10))(
+					[&](std::timed_mutex*){ entered = true; }
+				)
+			};
+		};
+		REQUIRE_THROWS_AS(waiting(), std::system_error);
+		REQUIRE_FALSE(entered);
+
+		{
+			std::lock_guard<std::mutex> signal(ready_lock);
+			done = true;
+		}
+		ready_changed.notify_all();
+		holder.join();
+
+		with {
+			locked_for(mutex, std::chrono::milliseconds(10))(
+				[&](std::timed_mutex*){ entered = true; }
+			)
+		};
+		REQUIRE(entered);
+	}
+}
+
+TEST_CASE("Test taking several locks", "[lock]"){
+	SECTION("Test the block receives each guarded value"){
+		Guarded<int> a(1);
+		Guarded<int, std::shared_mutex> b(2);
+		with {
+			lock_all(locked(a), locked_shared(b))(
+				[&](int* x, const int* y){
+					*x += *y;
+				}
+			)
+		};
+
+		with {
+			locked(a)([&](int* x){ REQUIRE(*x == 3); })
+		};
+	}
+
+	SECTION("Test opposite orders do not deadlock"){
+		Guarded<long> a(0);
+		Guarded<long> b(0);
+		auto transfer = [](Guarded<long>& from, Guarded<long>& to){
+			for (int i = 0; i < 10000; ++i) {
+				with {
+					lock_all(locked(from), locked(to))(
+						[&](long* f, long* t){
+							--*f;
+							++*t;
+						}
+					)
+				};
+			}
+		};
+		std::thread forward([&]{ transfer(a, b); });
+		std::thread backward([&]{ transfer(b, a); });
+		forward.join();
+		backward.join();
+
+		with {
+			lock_all(locked(a), locked(b))(
+				[&](long* x, long* y){
+					REQUIRE(*x == 0);
+					REQUIRE(*y == 0);
+				}
+			)
+		};
+	}
+
+	SECTION("Test nothing stays locked when a lock times out"){
+		std::mutex first;
+		std::timed_mutex second;
+		second.lock();
+		bool timed_out = false;
+		// Catch's assertions are not thread safe, so the outcome is checked
+		// back on this thread
+		std::thread waiter([&]{
+			try{
+				with {
+					lock_all(locked(first), locked_for(second, std::chrono::milliseconds(10)))()
+				};
+			} catch (std::system_error& e) {
+				timed_out = e.code() == std::errc::timed_out;
+			}
+		});
+		waiter.join();
+		second.unlock();
+
+		REQUIRE(timed_out);
+
+		REQUIRE(first.try_lock());
+		first.unlock();
+	}
+
+	SECTION("Test locks are released in reverse"){
+		std::mutex first;
+		std::mutex second;
+		auto throwing = [&]{
+			with {
+				lock_all(locked(first), locked(second))(
+					[&](std::mutex*, std::mutex*){ throw std::runtime_error("lock_all"); }
+				)
+			};
+		};
+		REQUIRE_THROWS_AS(throwing(), std::runtime_error);
+		REQUIRE(first.try_lock());
+		REQUIRE(second.try_lock());
+		first.unlock();
+		second.unlock();
+	}
+}
+
+namespace {
+
+	LockReport lock_report(const std::string& name){
+		for (LockReport& report : lock_statistics()) {
+			if (report.name == name) {
+				return report;
+			}
+		}
+		return LockReport();
+	}
+
+};
+
+TEST_CASE("Test lock contention statistics", "[lock]"){
+	Guarded<int> counter(0);
+
+	SECTION("Test acquisitions and hold time are counted"){
+		reset_lock_statistics();
+		for (int i = 0; i < 3; ++i) {
+			with {
+				locked(counter, "test.counted")(
+					[&](int* value){ ++*value; }
+				)
+			};
+		}
+
+		LockReport report = lock_report("test.counted");
+		REQUIRE(report.acquisitions == 3);
+		REQUIRE(report.contentions == 0);
+		REQUIRE(report.wait.count() == 0);
+	}
+
+	SECTION("Test contention is counted"){
+		reset_lock_statistics();
+		std::thread waiter;
+		with {
+			locked(counter, "test.contended")(
+				[&](int*){
+					waiter = std::thread([&]{
+						with {
+							locked(counter, "test.contended")(
+								[&](int* value){ ++*value; }
+							)
+						};
+					});
+					// the queue depth is recorded before the waiter blocks
+					while (lock_report("test.contended").max_queue_depth == 0) {
+						std::this_thread::yield();
+					}
+				}
+			)
+		};
+		waiter.join();
+
+		LockReport report = lock_report("test.contended");
+		REQUIRE(report.acquisitions == 2);
+		REQUIRE(report.contentions == 1);
+		REQUIRE(report.max_queue_depth == 1);
+		REQUIRE(report.wait.count() > 0);
+		REQUIRE(report.hold >= report.wait);
+
+		std::vector<LockReport> hottest = hottest_locks(1);
+		REQUIRE(hottest.size() == 1);
+		REQUIRE(hottest.front().name == "test.contended");
+	}
+
+	SECTION("Test lock_all counts each lock once, however often it backs off"){
+		reset_lock_statistics();
+		Guarded<int> other(0);
+		std::atomic<bool> held{false};
+		std::thread holder([&]{
+			with {
+				locked(other)(
+					[&](int*){
+						held = true;
+						std::this_thread::sleep_for(std::chrono::milliseconds(20));
+					}
+				)
+			};
+		});
+		while (!held) {
+			std::this_thread::yield();
+		}
+		with {
+			lock_all(locked(counter, "test.all.free"), locked(other, "test.all.busy"))()
+		};
+		holder.join();
+
+		LockReport free = lock_report("test.all.free");
+		REQUIRE(free.acquisitions == 1);
+		REQUIRE(free.contentions == 0);
+		REQUIRE(free.wait.count() == 0);
+		LockReport busy = lock_report("test.all.busy");
+		REQUIRE(busy.acquisitions == 1);
+		REQUIRE(busy.contentions == 1);
+		REQUIRE(busy.max_queue_depth == 1);
+		REQUIRE(busy.wait.count() > 0);
+	}
+
+	SECTION("Test only locks taken in observed contexts are counted"){
+		reset_lock_statistics();
+		auto lock = locked(counter, "test.unobserved");
+		ContextAccess::enter(lock);
+		ContextAccess::exit(lock, nullptr);
+
+		REQUIRE(lock_report("test.unobserved").acquisitions == 0);
+	}
+
+	SECTION("Test counts of exited threads are kept"){
+		reset_lock_statistics();
+		std::thread worker([&]{
+			with {
+				lock_all(locked(counter, "test.exited"))()
+			};
+		});
+		worker.join();
+
+		REQUIRE(lock_report("test.exited").acquisitions == 1);
+
+		reset_lock_statistics();
+		REQUIRE(lock_report("test.exited").acquisitions == 0);
+	}
+}
@@ -0,0 +1,141 @@
+#include <contextual/perf.h>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace Contextual;
+
+
+namespace {
+
+	CounterReport counted(const std::string& name){
+		for (CounterReport& report : counter_statistics()) {
+			if (report.name == name) {
+				return report;
+			}
+		}
+		return CounterReport();
+	}
+
+};
+
+TEST_CASE("Test counters of code blocks", "[perf]"){
+	reset_counter_statistics();
+
+	SECTION("Test a counter can always be read, one way or another"){
+		REQUIRE(counter_source(CounterKind::page_faults) != CounterSource::none);
+		REQUIRE(counter_source(CounterKind::context_switches) != CounterSource::none);
+	}
+
+	SECTION("Test the block's counts are given to the caller"){
+		CounterValues values;
+		with {
+			PerfCounters(values, "test.perf.touch")([&](CounterValues* counters){
+				REQUIRE(counters == &values);
+				// Touches fresh pages, and spends some CPU time
+				std::vector<char> pages(16 << 20);
+				for (std::size_t i = 0; i < pages.size(); i += 4096) {
+					pages[i] = 1;
+				}
+			})
+		};
+		REQUIRE(values.has(CounterKind::page_faults));
+		REQUIRE(values[CounterKind::page_faults] > 0);
+		REQUIRE(values.cpu_time.count() > 0);
+		for (std::size_t i = 0; i < counter_count; ++i) {
+			CounterKind counter = static_cast<CounterKind>(i);
+			REQUIRE(values.has(counter) == (counter_source(counter) != CounterSource::none));
+		}
+	}
+
+	SECTION("Test counts are summed per context name over threads"){
+		auto run = []{
+			for (int i = 0; i < 5; ++i) {
+				with {
+					PerfCounters("test.perf.sum")([&](CounterValues* counters){})
+				};
+			}
+		};
+		run();
+		std::thread other(run);
+		other.join();
+		CounterReport report = counted("test.perf.sum");
+		REQUIRE(report.count == 10);
+		REQUIRE(report.total.has(CounterKind::page_faults));
+	}
+
+	SECTION("Test nested contexts count their own blocks"){
+		CounterValues outer;
+		CounterValues inner;
+		with {
+			PerfCounters(outer, "test.perf.outer")([&](CounterValues*){
+				with {
+					PerfCounters(inner, "test.perf.inner")([&](CounterValues*){
+						std::vector<char> pages(4 << 20);
+						for (std::size_t i = 0; i < pages.size(); i += 4096) {
+							pages[i] = 1;
+						}
+					})
+				};
+			})
+		};
+		REQUIRE(outer[CounterKind::page_faults] >= inner[CounterKind::page_faults]);
+		REQUIRE(outer.cpu_time >= inner.cpu_time);
+	}
+
+	SECTION("Test counts are kept when the block throws"){
+		REQUIRE_THROWS(
+			with {
+				PerfCounters("test.perf.throws")([&](CounterValues*){
+					throw std::runtime_error("failed");
+				})
+			}
+		);
+		REQUIRE(counted("test.perf.throws").count == 1);
+	}
+
+	SECTION("Test multiplexed counters are scaled by the span they ran for"){
+		// Ran for a tenth of the time before the span, and 900 of its 1000ns
+		_CounterReading start;
+		start.values[0] = 100;
+		start.enabled[0] = 1000;
+		start.running[0] = 100;
+		_CounterReading end = start;
+		end.values[0] = 190;
+		end.enabled[0] = 2000;
+		end.running[0] = 1000;
+		REQUIRE(end.since(start, 0) == 100);
+		// Not in a group, so never scaled
+		end.values[1] = 7;
+		REQUIRE(end.since(start, 1) == 7);
+	}
+
+	SECTION("Test names beyond a thread's cap are counted together"){
+		// On a thread of its own, as each thread's names are capped
+		std::thread counting([]{
+			for (int i = 0; i < 1025; ++i) {
+				std::string name = "test.perf.capped." + std::to_string(i);
+				with {
+					PerfCounters(name.c_str())([&](CounterValues*){})
+				};
+			}
+		});
+		counting.join();
+		REQUIRE(counted("test.perf.capped.1023").count == 1);
+		REQUIRE(counted("test.perf.capped.1024").count == 0);
+		REQUIRE(counted("(other names)").count == 1);
+	}
+
+	SECTION("Test reset and dump"){
+		with {
+			PerfCounters("test.perf.dump")([&](CounterValues*){})
+		};
+		std::ostringstream out;
+		dump_counter_statistics(out);
+		REQUIRE(out.str().find("context\tcount\tcpu_ns\tinstructions") == 0);
+		REQUIRE(out.str().find("test.perf.dump\t1\t") != std::string::npos);
+		reset_counter_statistics();
+		REQUIRE(counted("test.perf.dump").count == 0);
+	}
+}
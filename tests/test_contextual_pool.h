@@ -0,0 +1,314 @@
+#include <contextual/pool.h>
+#include <atomic>
+#include <set>
+#include <thread>
+#include <vector>
+
+using namespace Contextual;
+
+
+namespace Contextual {
+
+	// An object that is expensive to make, numbered in the order made
+	struct Pooled {
+		static std::atomic<int> opened;
+		int id;
+
+		Pooled() : id(++opened){};
+	};
+
+	std::atomic<int> Pooled::opened{0};
+
+};
+
+namespace {
+
+	PoolOptions pool_options(std::size_t min_size, std::size_t max_size, std::size_t thread_cache=2){
+		PoolOptions options;
+		options.min_size = min_size;
+		options.max_size = max_size;
+		options.thread_cache = thread_cache;
+		options.wait = std::chrono::milliseconds(20);
+		return options;
+	}
+
+};
+
+TEST_CASE("Test pools of objects", "[pool]"){
+	Pooled::opened = 0;
+
+	SECTION("Test objects are constructed lazily, beyond the minimum"){
+		Pool<Pooled> pool(pool_options(2, 4));
+		REQUIRE(pool.size() == 2);
+		REQUIRE(Pooled::opened == 2);
+		int id = 0;
+		with {
+			pool.borrow()([&](Pooled* pooled){
+				id = pooled->id;
+			})
+		};
+		REQUIRE(id != 0);
+		REQUIRE(pool.size() == 2);
+	}
+
+	SECTION("Test a borrowed object is lent again, first to the same thread"){
+		Pool<Pooled> pool(pool_options(0, 4));
+		Pooled* first = nullptr;
+		Pooled* second = nullptr;
+		with {
+			pool.borrow()([&](Pooled* pooled){ first = pooled; })
+		};
+		with {
+			pool.borrow()([&](Pooled* pooled){ second = pooled; })
+		};
+		REQUIRE(first == second);
+		REQUIRE(Pooled::opened == 1);
+	}
+
+	SECTION("Test nested borrows get different objects"){
+		Pool<Pooled> pool(pool_options(0, 4, 0));
+		with {
+			pool.borrow()([&](Pooled* outer){
+				with {
+					pool.borrow()([&](Pooled* inner){
+						REQUIRE(outer != inner);
+					})
+				};
+			})
+		};
+		REQUIRE(pool.size() == 2);
+	}
+
+	SECTION("Test an object the block threw from is discarded"){
+		Pool<Pooled> pool(pool_options(0, 4));
+		Pooled* thrown = nullptr;
+		REQUIRE_THROWS_AS(
+			with {
+				pool.borrow()([&](Pooled* pooled){
+					thrown = pooled;
+					throw std::runtime_error("broken");
+				})
+			},
+			std::runtime_error
+		);
+		REQUIRE(pool.size() == 0);
+		REQUIRE(pool.discarded() == 1);
+		with {
+			pool.borrow()([&](Pooled* pooled){
+				REQUIRE(pooled->id == 2);
+			})
+		};
+	}
+
+	SECTION("Test a borrow can poison its object"){
+		Pool<Pooled> pool(pool_options(1, 4));
+		auto borrowed = pool.borrow();
+		with {
+			borrowed([&](Pooled* pooled){
+				borrowed.poison();
+			})
+		};
+		REQUIRE(pool.discarded() == 1);
+		with {
+			borrowed([&](Pooled* pooled){
+				REQUIRE(pooled->id == 2);
+			})
+		};
+		REQUIRE(pool.discarded() == 1);
+	}
+
+	SECTION("Test borrowing waits for an object, then times out"){
+		Pool<Pooled> pool(pool_options(0, 1));
+		bool timed_out = false;
+		with {
+			pool.borrow()([&](Pooled*){
+				try {
+					with {
+						pool.borrow()([&](Pooled*){})
+					};
+				} catch (const std::system_error& e) {
+					timed_out = e.code() == std::errc::timed_out;
+				}
+			})
+		};
+		REQUIRE(timed_out);
+		REQUIRE(pool.size() == 1);
+	}
+
+	SECTION("Test a waiting borrower gets an object given back"){
+		PoolOptions options = pool_options(0, 1);
+		options.wait = std::chrono::seconds(10);
+		Pool<Pooled> pool(options);
+		std::atomic<bool> lent{false};
+		std::atomic<bool> borrowed{false};
+		std::thread holder([&]{
+			with {
+				pool.borrow()([&](Pooled*){
+					lent = true;
+					std::this_thread::sleep_for(std::chrono::milliseconds(20));
+				})
+			};
+		});
+		while (!lent) {
+			std::this_thread::yield();
+		}
+		with {
+			pool.borrow()([&](Pooled*){ borrowed = true; })
+		};
+		holder.join();
+		REQUIRE(borrowed);
+		REQUIRE(Pooled::opened == 1);
+	}
+
+	SECTION("Test objects cached by a thread go back to the pool as it exits"){
+		Pool<Pooled> pool(pool_options(0, 2));
+		std::thread([&]{
+			with {
+				pool.borrow()([&](Pooled*){})
+			};
+		}).join();
+		with {
+			pool.borrow()([&](Pooled* pooled){
+				REQUIRE(pooled->id == 1);
+			})
+		};
+	}
+
+	SECTION("Test objects cached by a thread that lives on can be borrowed elsewhere"){
+		Pool<Pooled> pool(pool_options(0, 2));
+		std::atomic<bool> cached{false};
+		std::atomic<bool> done{false};
+		// Gives both objects back into its cache, then stays alive
+		std::thread holder([&]{
+			with {
+				pool.borrow()([&](Pooled*){
+					with {
+						pool.borrow()([&](Pooled*){})
+					};
+				})
+			};
+			cached = true;
+			while (!done) {
+				std::this_thread::yield();
+			}
+		});
+		while (!cached) {
+			std::this_thread::yield();
+		}
+		std::set<Pooled*> borrowed;
+		try {
+			with {
+				pool.borrow()([&](Pooled* outer){
+					with {
+						pool.borrow()([&](Pooled* inner){
+							borrowed = {outer, inner};
+						})
+					};
+				})
+			};
+		} catch (const std::system_error&) {
+			// timed out, and so left empty
+		}
+		done = true;
+		holder.join();
+		REQUIRE(borrowed.size() == 2);
+		REQUIRE(Pooled::opened == 2);
+	}
+
+	SECTION("Test a factory that throws leaves its slot to be filled later"){
+		bool failing = true;
+		Pool<Pooled> pool(pool_options(0, 1), [&]{
+			if (failing) {
+				throw std::runtime_error("unavailable");
+			}
+			return std::make_unique<Pooled>();
+		});
+		REQUIRE_THROWS_AS(
+			with {
+				pool.borrow()([&](Pooled*){})
+			},
+			std::runtime_error
+		);
+		REQUIRE(pool.size() == 0);
+		failing = false;
+		with {
+			pool.borrow()([&](Pooled* pooled){
+				REQUIRE(pooled->id == 1);
+			})
+		};
+		REQUIRE(pool.size() == 1);
+	}
+
+	SECTION("Test a factory that throws for a waiting borrower"){
+		PoolOptions options = pool_options(0, 1, 0);
+		options.wait = std::chrono::seconds(10);
+		std::atomic<bool> failing{false};
+		Pool<Pooled> pool(options, [&]{
+			if (failing) {
+				throw std::runtime_error("unavailable");
+			}
+			return std::make_unique<Pooled>();
+		});
+		std::atomic<bool> lent{false};
+		// Discards its object while the other borrower waits, so that the
+		// waiter has to make another
+		std::thread holder([&]{
+			auto borrowed = pool.borrow();
+			with {
+				borrowed([&](Pooled*){
+					lent = true;
+					std::this_thread::sleep_for(std::chrono::milliseconds(20));
+					borrowed.poison();
+				})
+			};
+		});
+		while (!lent) {
+			std::this_thread::yield();
+		}
+		failing = true;
+		bool thrown = false;
+		try {
+			with {
+				pool.borrow()([&](Pooled*){})
+			};
+		} catch (const std::runtime_error&) {
+			thrown = true;
+		}
+		holder.join();
+		REQUIRE(thrown);
+		REQUIRE(pool.size() == 0);
+		failing = false;
+		with {
+			pool.borrow()([&](Pooled* pooled){
+				REQUIRE(pooled->id == 2);
+			})
+		};
+		REQUIRE(pool.size() == 1);
+	}
+
+	SECTION("Test many threads never share an object nor exceed the maximum"){
+		Pool<Pooled> pool(pool_options(0, 4));
+		std::atomic<int> in_use[5] = {};
+		std::atomic<bool> shared{false};
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 8; ++t) {
+			threads.emplace_back([&]{
+				for (int i = 0; i < 2000; ++i) {
+					with {
+						pool.borrow()([&](Pooled* pooled){
+							if (in_use[pooled->id].fetch_add(1) != 0) {
+								shared = true;
+							}
+							in_use[pooled->id].fetch_sub(1);
+						})
+					};
+				}
+			});
+		}
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+		REQUIRE(!shared);
+		REQUIRE(Pooled::opened <= 4);
+	}
+}
@@ -0,0 +1,87 @@
+#include <contextual.h>
+#include <memory>
+
+using namespace Contextual;
+
+
+namespace Contextual {
+
+	// Can only be returned through guaranteed copy elision
+	struct Pinned {
+		int value;
+		explicit Pinned(int value): value(value){};
+		Pinned(const Pinned&) = delete;
+		Pinned(Pinned&&) = delete;
+	};
+
+};
+
+
+TEST_CASE("Test contexts returning values", "[result]"){
+	IData data{"admin", "password123"};
+
+	SECTION("Test the value is returned after exit"){
+		auto password = with_result(Resource(data),
+			[&](auto resource){
+				return resource->password;
+			}
+		);
+		REQUIRE(password == "xxxxxxxxx");
+		REQUIRE(data.password == "password123");
+		REQUIRE(data.logged_in == true);
+	}
+
+	SECTION("Test move-only and immovable results"){
+		std::unique_ptr<int> owned = with_result(StaticPassword(data),
+			[&](auto resource){
+				return std::make_unique<int>(7);
+			}
+		);
+		REQUIRE(*owned == 7);
+
+		Pinned pinned = with_result(StaticPassword(data),
+			[&](auto resource) noexcept {
+				return Pinned(11);
+			}
+		);
+		REQUIRE(pinned.value == 11);
+	}
+
+	SECTION("Test void results"){
+		with_result(Resource(data),
+			[&](auto resource){
+				resource->username = "guest";
+			}
+		);
+		REQUIRE(data.username == "guest");
+	}
+
+	SECTION("Test suppressed exceptions give a default value"){
+		int value = with_result(Resource(data),
+			[&](auto resource) -> int {
+				throw std::runtime_error("");
+			}
+		);
+		REQUIRE(value == 0);
+		REQUIRE(data.password == "password123");
+	}
+
+	SECTION("Test propagated exceptions"){
+		Observer observer(data);
+		REQUIRE_THROWS_AS(with_result(observer,
+			[&](auto resource) -> int {
+				throw std::out_of_range("");
+			}
+		), std::out_of_range);
+		REQUIRE(observer.exits == 1);
+	}
+
+	SECTION("Test immovable results cannot hide an exception"){
+		REQUIRE_THROWS_AS(with_result(Resource(data),
+			[&](auto resource) -> Pinned {
+				throw std::runtime_error("");
+			}
+		), std::runtime_error);
+		REQUIRE(data.password == "password123");
+	}
+}
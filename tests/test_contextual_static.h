@@ -0,0 +1,119 @@
+#include <contextual.h>
+#include <type_traits>
+
+using namespace Contextual;
+
+
+namespace Contextual {
+
+	class StaticPassword : public StaticResource<StaticPassword, IData> {
+	private:
+		friend struct ContextAccess;
+		std::string _password = "xxxxxxxxx";
+		void enter() {
+			std::swap(_password, resources->password);
+		}
+
+		bool exit(std::exception_ptr e) {
+			std::swap(_password, resources->password);
+			resources->logged_in = true;
+			return true;
+		}
+	public:
+		StaticPassword(IData &resources): StaticResource<StaticPassword, IData>(resources){};
+		StaticPassword(IData* resources): StaticResource<StaticPassword, IData>(resources){};
+	};
+
+};
+
+
+TEST_CASE("Test statically dispatched resources", "[static]"){
+	IData data{"admin", "password123"};
+
+	SECTION("Test no vtable is needed"){
+		REQUIRE(std::is_polymorphic<Resource>::value);
+		REQUIRE_FALSE(std::is_polymorphic<StaticPassword>::value);
+	}
+
+	SECTION("Test resource acquisition and release"){
+		with {
+			StaticPassword(data)(
+				[&](auto resource){
+					REQUIRE(resource->username == "admin");
+					REQUIRE(resource->password == "xxxxxxxxx");
+				}
+			)
+		};
+
+		REQUIRE(data.password == "password123");
+		REQUIRE(data.logged_in == true);
+	}
+
+	SECTION("Test release with exceptions"){
+		with {
+			StaticPassword(&data)(
+				[&](auto resource){
+					throw std::runtime_error("");
+				}
+			)
+		};
+
+		REQUIRE(data.password == "password123");
+	}
+
+	SECTION("Test empty code block"){
+		with {
+			StaticPassword(data)()
+		};
+
+		REQUIRE(data.logged_in == true);
+	}
+}
+
+namespace Contextual {
+
+	class Counter : public StaticResource<Counter, int> {
+	private:
+		friend struct ContextAccess;
+		void enter() noexcept {
+			++*resources;
+		}
+
+		bool exit(std::exception_ptr e) noexcept {
+			--*resources;
+			return true;
+		}
+	public:
+		Counter(int &resources): StaticResource<Counter, int>(resources){};
+	};
+
+};
+
+
+TEST_CASE("Test contexts that cannot throw", "[nothrow]"){
+	int depth = 0;
+	int seen = 0;
+	auto quiet = [&](auto resource) noexcept -> void { seen = *resource == 1; };
+	auto loud = [&](auto resource) -> void { throw std::runtime_error(""); };
+
+	SECTION("Test noexcept detection"){
+		static_assert(is_nothrow_context_v<Counter, decltype(quiet)>, "");
+		REQUIRE_FALSE(is_nothrow_context<Counter, decltype(loud)>::value);
+		// Neither has noexcept enter and exit methods
+		REQUIRE_FALSE(is_nothrow_context<StaticPassword, decltype(quiet)>::value);
+		REQUIRE_FALSE(is_nothrow_context<Resource, decltype(quiet)>::value);
+	}
+
+	SECTION("Test both paths enter and exit"){
+		with {
+			Counter(depth)(quiet)
+		};
+		REQUIRE(seen == 1);
+		REQUIRE(depth == 0);
+
+		with {
+			Counter(depth)(loud)
+		};
+		REQUIRE(depth == 0);
+	}
+}
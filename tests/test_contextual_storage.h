@@ -0,0 +1,97 @@
+#include <contextual.h>
+
+using namespace Contextual;
+
+
+namespace Contextual {
+
+	class Session : public StaticResource<Session, IData, Owned> {
+	private:
+		friend struct ContextAccess;
+		std::string _password = "xxxxxxxxx";
+		void enter() {
+			std::swap(_password, resources->password);
+		}
+
+		bool exit(std::exception_ptr e) {
+			std::swap(_password, resources->password);
+			resources->logged_in = true;
+			return true;
+		}
+	public:
+		const IData* address = resources.get();
+
+		Session(IData &&resources): StaticResource<Session, IData, Owned>(std::move(resources)){};
+		Session(const IData &resources): StaticResource<Session, IData, Owned>(resources){};
+		Session(std::string username, std::string password) : 
+			StaticResource<Session, IData, Owned>(std::in_place, username, password){};
+	};
+
+	class OwnedResource : public IResource<IData, Owned> {
+	private:
+		void enter() override {
+			resources->logged_in = true;
+		}
+
+		bool exit(std::exception_ptr e) override {
+			return true;
+		}
+	public:
+		OwnedResource(std::string username) : IResource<IData, Owned>(std::in_place, username){};
+	};
+
+};
+
+
+TEST_CASE("Test data storage policies", "[storage]"){
+	IData data{"admin", "password123"};
+
+	SECTION("Test owned data constructed in place"){
+		with {
+			Session("admin", "password123")(
+				[&](auto resource){
+					REQUIRE(resource->username == "admin");
+					REQUIRE(resource->password == "xxxxxxxxx");
+				}
+			)
+		};
+	}
+
+	SECTION("Test owned data lives inside the resource manager"){
+		Session session(IData{"admin", "password123"});
+		REQUIRE(session.address != nullptr);
+
+		with {
+			session(
+				[&](auto resource){
+					REQUIRE(resource == session.address);
+				}
+			)
+		};
+	}
+
+	SECTION("Test owned data is a copy"){
+		with {
+			Session(data)(
+				[&](auto resource){
+					REQUIRE(resource != &data);
+					resource->username = "guest";
+				}
+			)
+		};
+
+		REQUIRE(data.username == "admin");
+		REQUIRE(data.logged_in == false);
+	}
+
+	SECTION("Test owned data with virtual dispatch"){
+		with {
+			OwnedResource("guest")(
+				[&](auto resource){
+					REQUIRE(resource->username == "guest");
+					REQUIRE(resource->logged_in == true);
+				}
+			)
+		};
+	}
+}
@@ -0,0 +1,100 @@
+#include <contextual/trace.h>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+using namespace Contextual;
+
+
+namespace {
+
+	std::vector<TraceEvent> recorded(const char* name){
+		std::vector<TraceEvent> events;
+		TraceRecorder::global().drain(events);
+		std::vector<TraceEvent> named;
+		for (const TraceEvent& event : events) {
+			if (std::string(event.name) == name) {
+				named.push_back(event);
+			}
+		}
+		return named;
+	}
+
+};
+
+TEST_CASE("Test tracing contexts", "[trace]"){
+	TraceRecorder::global();
+	recorded("");
+	int data = 0;
+
+	SECTION("Test nested contexts are recorded inside each other"){
+		with {
+			Timed(data)(
+				[&](int*){
+					with { Timed(data)() };
+				}
+			)
+		};
+
+		std::vector<TraceEvent> events = recorded("test.timed");
+		REQUIRE(events.size() == 2);
+		// the inner context ends first
+		REQUIRE(events[0].begin >= events[1].begin);
+		REQUIRE(events[0].end <= events[1].end);
+		REQUIRE(events[0].thread == events[1].thread);
+	}
+
+	SECTION("Test exceptions are flagged"){
+		with {
+			Timed(data)([&](int*){ throw std::runtime_error("trace"); })
+		};
+
+		std::vector<TraceEvent> events = recorded("test.timed");
+		REQUIRE(events.size() == 1);
+		REQUIRE(events[0].exception);
+	}
+
+	SECTION("Test names built at run time outlive their contexts"){
+		// Too long to be kept inside the string, so freed with the context
+		std::string first = "test.traced." + std::string(40, 'a');
+		std::string second = "test.traced." + std::string(40, 'b');
+		with { Labelled(data, first)() };
+		with { Labelled(data, second)() };
+
+		std::vector<TraceEvent> events;
+		TraceRecorder::global().drain(events);
+		REQUIRE(events.size() == 2);
+		REQUIRE(events[0].name == first);
+		REQUIRE(events[1].name == second);
+	}
+
+	SECTION("Test events of exited threads are kept"){
+		std::thread worker([&]{ with { Timed(data)() }; });
+		worker.join();
+
+		std::vector<TraceEvent> events = recorded("test.timed");
+		REQUIRE(events.size() == 1);
+	}
+
+	SECTION("Test the trace file is JSON"){
+		const char* path = "contextual_trace_test.json";
+		{
+			TraceFile trace(path);
+			with { Timed(data)() };
+			REQUIRE(trace.flush() >= 1);
+			with { Timed(data)([&](int*){ throw std::runtime_error("trace"); }) };
+		}
+
+		std::ifstream in(path);
+		std::stringstream contents;
+		contents << in.rdbuf();
+		std::string json = contents.str();
+		std::remove(path);
+
+		REQUIRE(json.rfind("{\"traceEvents\": [", 0) == 0);
+		REQUIRE(json.substr(json.size() - 4) == "\n]}\n");
+		REQUIRE(json.find("\"name\": \"test.timed\", \"cat\": \"context\", \"ph\": \"X\"") != std::string::npos);
+		REQUIRE(json.find("\"exception\": true") != std::string::npos);
+	}
+}